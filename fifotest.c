@@ -7,9 +7,18 @@
  *  License.
  */
 
+#define _GNU_SOURCE
+
+#include <endian.h>
 #include <errno.h>
+#include <limits.h>
+#include <poll.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,11 +30,16 @@
 #include <libbrahe/prng.h>
 
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#include <linux/perf_event.h>
 #include <linux/serial.h>
 
 
@@ -34,9 +48,55 @@
 
 #define MAX_LIST_SIZE		64
 
+#define TTY_BUF_SIZE		4096	/* N_TTY_BUF_SIZE */
+#define MAX_AUTO_LENS		32
+
+#define MAX_QSAMPLES		65536
+
+#define VERIFY_RING_SIZE	(1 << 20)
+#define VERIFY_POLL_US		50
+
+#define DEFAULT_HASH_BLOCK	64
+#define DEFAULT_SAMPLE_STEP	16
+
+#define MAX_ERR_MODS		4
+#define DEFAULT_ERR_MOD		16
+
+#define HIST_BUCKETS		160
+#define LEN_BUCKETS		13	/* powers of two up to MAX_MAX_MSG_LEN */
+
+#define MODEM_SETTLE_US		1000
+
+#define RS485_RELEASE_TIMEOUT	100	/* ms, on top of delay_rts_after_send */
+
+#define SEARCH_WINDOW		100
+#define SEARCH_MAX_GAP		100000	/* µs */
+#define SEARCH_GAP_RESOLUTION	100	/* µs */
+#define SEARCH_MIN_SPEED	9600
+
+#define SWEEP_WINDOW		100
+
+#define CHAR_REPEAT		10
+
+#define MAX_LOADS		8
+#define LOAD_PHASE		100	/* messages */
+#define LOAD_PERIOD_US		1000
+#define LOAD_MEM_SIZE		(64 << 20)
+#define LOAD_MEM_CHUNK		(64 << 10)
+#define LOAD_CACHE_SIZE		(32 << 20)
+
+#define MAX_IRQ_CPUS		256
+
+#define MAX_RECEIVERS		8
+
+#define MAX_METRICS		32
+#define MAX_TOLERANCES		16
+#define DEFAULT_TOLERANCE	10	/* percent */
+
 #define TX_TIMEOUT		5
 #define RX_TIMEOUT		5
 #define RX_TIMEOUT_INIT		60
+#define RX_DRAIN_QUIET		10	/* ms */
 
 #define max(x, y) ({ \
 	typeof(x) _x = (x);     \
@@ -51,8 +111,39 @@
 	_x < _y ? _x : _y; })
 
 static const char *opt_txdev, *opt_rxdev;
+static const char *opt_payload;
+static const char *opt_qlog;
+static uint32_t opt_qsample;
+static const struct modem_line *opt_modem;
+static const struct framing *opt_framing;
+static int opt_break = -1;
+static int opt_break_at = -1;
+static int opt_rs485;
+static uint32_t opt_rs485_before, opt_rs485_after;
+static int opt_echo, opt_pingpong;
+static int opt_search;
+static uint32_t opt_search_window = SEARCH_WINDOW;
+static uint32_t opt_gap_min, opt_gap_max;
+static int opt_open_bench;
+static int opt_keep_going;
+static unsigned int opt_err_mods[MAX_ERR_MODS], opt_nerr_mods;
+static uint32_t opt_prefetch;
+static uint32_t opt_duration;
+static uint32_t opt_rate;
+static int opt_rate_bytes;
+static uint32_t opt_period;
+static int opt_verify_thread;
+static int opt_latency_timer = -1;
+static int opt_latency_sweep;
+static uint32_t opt_characterize;
+static uint32_t opt_load_phase = LOAD_PHASE;
+static const char *opt_baseline, *opt_save_baseline;
+static const char *opt_irq;
+static int opt_cpu_cost, opt_perf;
+static uint32_t opt_flush_probe;
 static uint32_t opt_seed = 42;
 static uint32_t opt_msglen = DEFAULT_MAX_MSG_LEN;
+static int opt_msglen_set;
 static uint32_t opt_nmsgs;
 static uint32_t opt_speed;
 static int opt_verbose;
@@ -69,18 +160,405 @@ static int opt_verbose;
 
 #define TAG_TX		ESC_BLUE "[tx] "
 #define TAG_RX		ESC_PURPLE "[rx] "
+#define TAG_VFY		ESC_CYAN "[vfy] "
 
 static brahe_prng_state_t prng;
+static brahe_prng_state_t gap_prng;	/* keeps data independent of gaps */
+
+/* Per-message timings of the individual stages of a transfer */
+enum msg_stage {
+	STAGE_RX_OPEN,
+	STAGE_TX_OPEN,
+	STAGE_TX_WRITE,
+	STAGE_TX_CLOSE,
+	MSG_STAGES
+};
+
+static const char * const msg_stage_names[MSG_STAGES] = {
+	[STAGE_RX_OPEN]		= "rx_open",
+	[STAGE_TX_OPEN]		= "tx_open",
+	[STAGE_TX_WRITE]	= "tx_write",
+	[STAGE_TX_CLOSE]	= "tx_close",
+};
+
+/* Threads whose CPU cost is accounted */
+enum cpu_role {
+	CPU_MAIN,
+	CPU_GEN,
+	CPU_TX,
+	CPU_RX,
+	CPU_VFY,
+	CPU_ROLES
+};
+
+static const char * const cpu_role_names[CPU_ROLES] = {
+	[CPU_MAIN]	= "main",
+	[CPU_GEN]	= "gen",
+	[CPU_TX]	= "tx",
+	[CPU_RX]	= "rx",
+	[CPU_VFY]	= "vfy",
+};
 
 struct msg {
 	struct msg *next;
 	unsigned int len;
+	unsigned int rxlen;		/* number of bytes to consume */
+	const unsigned char *data;	/* buf, or the payload file mapping */
+	const unsigned char *plain;	/* unframed data, when framing */
+	unsigned int plain_len;
+	int digest;			/* reduced verification data valid */
+	const uint32_t *hashes;		/* block sums of the first rxlen bytes */
+	uint64_t sum;			/* of the first rxlen bytes */
+	int brk;			/* offset of injected break, or -1 */
+	uint64_t tx_start, rx_end;	/* rx_end is zero on failure */
+	uint64_t stage[MSG_STAGES];	/* ns */
+	uint64_t cpu[CPU_ROLES];	/* ns of user and system time */
 	unsigned char buf[0];
 };
 
-static pthread_t rx_thread, tx_thread;
-static unsigned long long rx_bytes, tx_bytes;
+static int payload_fd = -1;
+static const unsigned char *payload_map;
+static size_t payload_size;
+static uint32_t *payload_hashes;
+static uint64_t payload_sum;
+
+/*
+ * Verification levels.  The reduced ones check each block's sum, or every nth
+ * or a random subset of the bytes, backed by a sum over the whole stream.  Both
+ * sums add up little-endian 64-bit words, so they cost less than a memcmp().
+ * The expected values are computed at generation.
+ */
+enum verify_mode {
+	VERIFY_FULL,
+	VERIFY_HASH,
+	VERIFY_SAMPLE,
+	VERIFY_RANDOM,
+};
+
+static const char * const verify_modes[] = {
+	[VERIFY_FULL]	= "full",
+	[VERIFY_HASH]	= "hash",
+	[VERIFY_SAMPLE]	= "sample",
+	[VERIFY_RANDOM]	= "random",
+};
+
+/* Receive side state of the message being verified */
+struct verify_state {
+	uint64_t block, sum;
+	unsigned int fill, idx;		/* bytes and index of the current block */
+	uint32_t rng;
+	unsigned int next;		/* next sampled offset */
+	uint32_t seq;			/* messages verified, kept across resets */
+};
+
+static enum verify_mode opt_verify;
+static unsigned int opt_verify_n;	/* block size, or sampling step */
+static struct verify_state verify_state;
+static unsigned long long verify_checked, verify_received;
+static unsigned int verify_sum_only;
+
+/*
+ * Latency histogram, with four sub-buckets per power of two nanoseconds
+ */
+struct hist {
+	unsigned long long count, sum, min, max;
+	unsigned long long bucket[HIST_BUCKETS];
+};
+
+static const struct modem_line {
+	const char *name;
+	int out, in;
+} modem_lines[] = {
+	{ "rts",	TIOCM_RTS,	TIOCM_CTS },
+	{ "dtr",	TIOCM_DTR,	TIOCM_DSR },
+};
+
+static struct hist modem_hist;
+static unsigned int modem_errors;
+
+static unsigned int breaks_sent, breaks_counted;
+
+static struct serial_rs485 rs485_saved;
+static int rs485_configured;
+static struct hist rs485_drain_hist, rs485_release_hist;
+static unsigned int rs485_unobserved;
+
+static struct hist rtt_hist[LEN_BUCKETS];
+
+static struct hist period_tx_hist, period_rx_hist;
+static unsigned int period_overruns;
+static uint64_t period_start;
+static volatile unsigned int period_frames = UINT_MAX;
+
+enum open_step {
+	OPEN_OPEN,
+	OPEN_TCGETATTR,
+	OPEN_TCSETATTR,
+	OPEN_CFSETSPEED,
+	OPEN_TCFLUSH,
+	OPEN_CLOSE,
+	OPEN_STEPS
+};
+
+static const char * const open_step_names[OPEN_STEPS] = {
+	[OPEN_OPEN]		= "open",
+	[OPEN_TCGETATTR]	= "tcgetattr",
+	[OPEN_TCSETATTR]	= "tcsetattr",
+	[OPEN_CFSETSPEED]	= "cfsetspeed",
+	[OPEN_TCFLUSH]		= "tcflush",
+	[OPEN_CLOSE]		= "close",
+};
+
+/* Per-step device_open() timings, when profiling */
+static struct hist *open_prof;
+static struct hist tx_open_prof[OPEN_STEPS], rx_open_prof[OPEN_STEPS];
+
+/*
+ * Single-producer/single-consumer ring of messages generated ahead of time.
+ * Each index is only written by its own side, and the semaphores carry the
+ * fill level and the required memory ordering.
+ */
+static struct msg *msg_ring[MAX_LIST_SIZE];
+static unsigned int msg_ring_head, msg_ring_tail;
+static sem_t msg_ring_space, msg_ring_filled;
+
+/*
+ * Single-producer/single-consumer byte ring between the receiver thread, which
+ * only drains the port, and the verifier thread
+ */
+static unsigned char verify_ring[VERIFY_RING_SIZE];
+static _Atomic unsigned long long verify_head, verify_tail;
+static volatile int verify_abort;
+static int verify_failed;
+static unsigned long long verify_max_depth, verify_stalls;
+
+/* Serial port info, as reported by TIOCGSERIAL on first open */
+struct port {
+	int probed, valid;
+	struct serial_struct ss;
+};
+
+static struct port tx_port, rx_port;
+
+static const char * const port_types[] = {
+	[PORT_UNKNOWN]	= "unknown",
+	[PORT_8250]	= "8250",
+	[PORT_16450]	= "16450",
+	[PORT_16550]	= "16550",
+	[PORT_16550A]	= "16550A",
+	[PORT_CIRRUS]	= "Cirrus",
+	[PORT_16650]	= "16650",
+	[PORT_16650V2]	= "16650V2",
+	[PORT_16750]	= "16750",
+	[PORT_STARTECH]	= "Startech",
+	[PORT_16C950]	= "16C950",
+	[PORT_16654]	= "16654",
+	[PORT_16850]	= "16850",
+	[PORT_RSA]	= "RSA",
+};
+
+/*
+ * Framing codecs wrapped around generated messages.  Byte stuffing is table
+ * driven: a byte with a non-zero enc[] entry is sent as the escape byte
+ * followed by that entry, and dec[] maps it back (zero is a bad escape).
+ */
+struct framing {
+	const char *name;
+	unsigned char delim, esc;
+	int opening;			/* frames also start with delim */
+	unsigned char enc[256], dec[256];
+	unsigned int (*encode)(const struct framing *f, const unsigned char *in,
+			       unsigned int len, unsigned char *out);
+	void (*decode)(const struct framing *f, const unsigned char *buf,
+		       unsigned int len);
+};
+
+/* Receive side decoder state of the frame in flight */
+struct frame_dec {
+	const struct msg *msg;
+	enum { FD_IDLE, FD_DATA, FD_ESC, FD_DONE } state;
+	unsigned int out;		/* decoded bytes */
+	unsigned int block;		/* COBS data bytes left in block */
+	int zero;			/* COBS implied zero pending */
+	int overflow, mismatch, bad;
+};
+
+static struct frame_dec frame_dec;
+static unsigned int frames_ok, frames_bad, frames_truncated;
+static unsigned int frame_bad_escapes, frame_lost_delims, frame_len_errors;
+static unsigned int frame_mismatches;
+static unsigned long long frame_raw_bytes, frame_plain_bytes, frame_good_bytes;
+
+/* Default message lengths around the FIFO and tty buffer boundaries */
+static unsigned int auto_lens[MAX_AUTO_LENS], nauto_lens;
+
+/*
+ * Background load generators, to put interrupt latency under pressure
+ */
+enum load_type {
+	LOAD_CPU,
+	LOAD_MEM,
+	LOAD_CACHE,
+	LOAD_SYSCALL,
+};
+
+static const char * const load_types[] = {
+	[LOAD_CPU]	= "cpu",
+	[LOAD_MEM]	= "mem",
+	[LOAD_CACHE]	= "cache",
+	[LOAD_SYSCALL]	= "syscall",
+};
+
+struct load {
+	enum load_type type;
+	unsigned int threads;
+	unsigned int duty;		/* percentage of each period */
+	int cpu;			/* or -1 for any */
+};
+
+static struct load loads[MAX_LOADS];
+static unsigned int nloads;
+static volatile int load_active;
+
+/* Results are kept separately for the idle (0) and loaded (1) phases */
+struct phase_stats {
+	unsigned int msgs, failures;
+	struct hist lat;
+};
+
+static struct phase_stats phase_stats[2];
+
+/* Time from start of transmission until reception is complete */
+static struct hist msg_lat_hist;
+static struct hist stage_hist[MSG_STAGES];
+
+/*
+ * Run summary, saved as a baseline or compared against one.  Informational
+ * metrics describe the configuration, and only warn when they differ.
+ */
+enum metric_kind {
+	METRIC_INFO,
+	METRIC_HIGHER,			/* higher is better */
+	METRIC_LOWER,			/* lower is better */
+};
+
+struct metric {
+	char name[32];
+	enum metric_kind kind;
+	double val;
+};
+
+static struct metric metrics[MAX_METRICS];
+static unsigned int nmetrics;
+
+struct tolerance {
+	const char *name;
+	double pct;
+};
+
+static double opt_tolerance = DEFAULT_TOLERANCE;
+static struct tolerance tolerances[MAX_TOLERANCES];
+static unsigned int ntolerances;
+
+/* sysfs latency_timer attributes of USB serial devices, and their settings */
+static const unsigned int latency_sweep[] = { 1, 2, 4, 8, 16, 32, 64 };
+static char tx_latency_path[PATH_MAX], rx_latency_path[PATH_MAX];
+static int tx_latency_saved = -1, rx_latency_saved = -1;
+
+/* CPU usage of one thread, from getrusage() and optional perf counters */
+enum perf_counter {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_COUNTERS
+};
+
+struct cpu_sample {
+	struct rusage ru;
+	int perf_fd[PERF_COUNTERS];
+};
+
+struct cpu_cost {
+	unsigned long long user, sys;	/* ns */
+	unsigned long long nvcsw, nivcsw;
+	unsigned long long perf[PERF_COUNTERS];
+};
+
+static struct cpu_cost cpu_cost[CPU_ROLES];
+static pthread_mutex_t cpu_cost_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hist cpu_msg_hist;
+static volatile int perf_unavailable;
+
+/* Interrupt counts of the UART's IRQ line, per CPU */
+static char irq_label[16];
+static unsigned int irq_ncpus;
+static unsigned long long irq_start[MAX_IRQ_CPUS], irq_cpu[MAX_IRQ_CPUS];
+static unsigned long long irq_total, irq_msg_min = ULLONG_MAX, irq_msg_max;
+static unsigned int irq_msgs;
+
+static pthread_t rx_thread, tx_thread, gen_thread, verify_thread;
+
+/*
+ * Receivers of each message: rxdev, followed by any further devices on a
+ * multi-drop bus or splitter.  The per-message fields belong to the
+ * receiver's thread until it is joined.
+ */
+struct receiver {
+	const char *pathname;
+	pthread_t thread;
+	struct msg *msg;
+	uint64_t rx_open, rx_end, cpu;	/* ns, rx_end is zero on failure */
+	unsigned long long bytes;
+	unsigned int msgs, failures;
+	struct hist lat;
+};
+
+static struct receiver receivers[MAX_RECEIVERS];
+static unsigned int nreceivers;
+static __thread struct receiver *rx_self;	/* in receive threads */
+static volatile int rx_collecting;	/* failures counted per message */
+static struct hist rx_skew_hist;
+/*
+ * Flush effectiveness: bytes still arriving after the receiver's flush, and
+ * before transmission starts, are left over from the previous message
+ */
+static struct hist flush_hist;
+static unsigned int flush_msgs, flush_leaks, flush_leak_max;
+static unsigned long long flush_leaked, flush_unconsumed;
+static unsigned int flush_len_msgs[LEN_BUCKETS], flush_len_leaks[LEN_BUCKETS];
+static unsigned long long flush_len_leaked[LEN_BUCKETS];
+static unsigned int prev_len, prev_rxlen;
+
+/*
+ * rx_bytes only counts rxdev, and per-message counters are updated once per
+ * message by receivers_collect(), so extra receivers don't inflate them
+ */
+static unsigned long long rx_bytes;
+static unsigned long long tx_bytes;
 static unsigned int msgs;
+static _Atomic unsigned int rx_failures;
+
+/* Error statistics, by message length and by first error offset modulo n */
+static unsigned int len_msgs[LEN_BUCKETS], len_errors[LEN_BUCKETS];
+static _Atomic unsigned int *err_mod_hist[MAX_ERR_MODS];
+static sem_t rx_ready;
+static uint64_t last_msg_end;
+static uint64_t run_start, rate_next;
+
+/* Open descriptors of the running tx/rx threads, for the queue sampler */
+static volatile int tx_fd = -1, rx_fd = -1;
+
+struct qsample {
+	uint32_t t_us;
+	uint32_t outq;
+	uint32_t inq;
+};
+
+static pthread_t qsample_thread;
+static volatile int qsampling;
+static struct qsample qsamples[MAX_QSAMPLES];
+static unsigned int nqsamples;
+static unsigned int max_outq, max_inq;
+static FILE *qlog;
 
 static const struct speed {
 	speed_t sym;
@@ -169,14 +647,98 @@ static speed_t get_speed_sym(unsigned speed)
 	return -1;
 }
 
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void ns_to_timespec(uint64_t ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / 1000000000ULL;
+	ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static unsigned int hist_index(uint64_t val)
+{
+	unsigned int e;
+
+	if (val < 4)
+		return val;
+
+	e = 63 - __builtin_clzll(val);
+	return min(4 * (e - 1) + (unsigned int)((val >> (e - 2)) & 3),
+		   HIST_BUCKETS - 1u);
+}
+
+static uint64_t hist_lower(unsigned int i)
+{
+	if (i < 4)
+		return i;
+
+	return (4ULL + i % 4) << (i / 4 - 1);
+}
+
+static void hist_add(struct hist *h, uint64_t val)
+{
+	if (!h->count || val < h->min)
+		h->min = val;
+	if (val > h->max)
+		h->max = val;
+	h->count++;
+	h->sum += val;
+	h->bucket[hist_index(val)]++;
+}
+
+static uint64_t hist_percentile(const struct hist *h, unsigned int pct)
+{
+	unsigned long long n = 0, target;
+	unsigned int i;
+
+	if (!h->count)
+		return 0;
+
+	target = (h->count * pct + 99) / 100;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		n += h->bucket[i];
+		if (n >= target)
+			return min(max(hist_lower(i), (uint64_t)h->min),
+				   (uint64_t)h->max);
+	}
+	return h->max;
+}
+
+static unsigned int len_bucket(unsigned int len)
+{
+	return min(31 - __builtin_clz(len), LEN_BUCKETS - 1);
+}
+
+static int run_done(void)
+{
+	if (opt_nmsgs && msgs >= opt_nmsgs)
+		return 1;
+	if (opt_duration &&
+	    now_ns() - run_start >= opt_duration * 1000000000ULL)
+		return 1;
+	return 0;
+}
+
 static const char *thread_prefix(void)
 {
 	pthread_t self = pthread_self();
+	unsigned int i;
 
 	if (self == rx_thread)
 		return TAG_RX;
+	for (i = 0; i < nreceivers; i++)
+		if (self == receivers[i].thread)
+			return TAG_RX;
 	if (self == tx_thread)
 		return TAG_TX;
+	if (self == verify_thread)
+		return TAG_VFY;
 
 	return "";
 }
@@ -196,113 +758,774 @@ static const char *thread_prefix(void)
 #define pr_error(fmt, ...) \
 	fprintf(stderr, "%s" ESC_RED fmt ESC_RM, thread_prefix(), ##__VA_ARGS__)
 
-static struct msg *msg_gen(int len)
+static void msg_set_break(struct msg *msg)
 {
-	struct msg *msg;
+	if (opt_break < 0)
+		msg->brk = -1;
+	else if (opt_break_at >= 0)
+		msg->brk = min((unsigned int)opt_break_at, msg->len);
+	else
+		msg->brk = brahe_prng_range(&prng, 0, msg->len);
+}
+
+static unsigned int stuff_encode(const struct framing *f,
+				 const unsigned char *in, unsigned int len,
+				 unsigned char *out)
+{
+	unsigned char *o = out;
 	unsigned int i;
 
-	if (len < 0)
-		len = brahe_prng_range(&prng, 1, -len);
+	*o++ = f->delim;
+	for (i = 0; i < len; i++) {
+		if (f->enc[in[i]]) {
+			*o++ = f->esc;
+			*o++ = f->enc[in[i]];
+		} else {
+			*o++ = in[i];
+		}
+	}
+	*o++ = f->delim;
 
-	msg = malloc(sizeof(*msg) + len);
-	memset(msg, 0, sizeof(*msg));
+	return o - out;
+}
 
-	msg->len = len;
-	for (i = 0; i < len; i++)
-		msg->buf[i] = brahe_prng_next(&prng);
+/* Consistent Overhead Byte Stuffing, followed by a zero delimiter */
+static unsigned int cobs_encode(const struct framing *f,
+				const unsigned char *in, unsigned int len,
+				unsigned char *out)
+{
+	unsigned char *code = out, *o = out + 1;
+	unsigned int i;
 
-	return msg;
+	*code = 1;
+	for (i = 0; i < len; i++) {
+		if (in[i]) {
+			*o++ = in[i];
+			if (++*code < 0xff)
+				continue;
+		}
+		code = o++;
+		*code = 1;
+	}
+	*o++ = 0;
+
+	return o - out;
 }
 
-static void print_stats(void)
+static void frame_emit(unsigned char c)
 {
-	pr_warn("MSG: %u, TX: %llu bytes, RX: %llu bytes\n", msgs, tx_bytes,
-		rx_bytes);
+	struct frame_dec *d = &frame_dec;
+
+	if (d->out == d->msg->plain_len) {
+		if (!d->overflow)
+			frame_len_errors++;
+		d->overflow = d->bad = 1;
+		return;
+	}
+
+	if (c != d->msg->plain[d->out] && !d->mismatch) {
+		pr_error("Frame payload mismatch at offset %u\n", d->out);
+		frame_mismatches++;
+		d->mismatch = d->bad = 1;
+	}
+	d->out++;
 }
 
-static void print_line(unsigned int index, const unsigned char *buf,
-		       unsigned int len)
+static void frame_close(void)
 {
-	unsigned int i;
-
-	pr_info("%04x:", index);
+	struct frame_dec *d = &frame_dec;
 
-	for (i = 0; i < len; i++)
-		printf(" %02x", buf[i]);
-	for (i = len; i < 16; i++)
-		printf("   ");
+	if (d->out != d->msg->plain_len && !d->overflow) {
+		pr_error("Frame length %u, expected %u\n", d->out,
+			 d->msg->plain_len);
+		frame_len_errors++;
+		d->bad = 1;
+	}
+	d->state = FD_DONE;
+}
 
-	printf(" |");
-	for (i = 0; i < len; i++)
-		putchar(buf[i] >= 32 && buf[i] < 127 ? buf[i] : '.');
-	puts("|");
+static void frame_bad_escape(unsigned char c)
+{
+	pr_error("Bad escape 0x%02x in frame at offset %u\n", c,
+		 frame_dec.out);
+	frame_bad_escapes++;
+	frame_dec.bad = 1;
 }
 
-static void print_buffer(const void *buf, unsigned int len)
+static void stuff_decode(const struct framing *f, const unsigned char *buf,
+			 unsigned int len)
 {
+	struct frame_dec *d = &frame_dec;
 	unsigned int i;
+	unsigned char c;
 
-	for (i = 0; i < len; i += 16)
-		print_line(i, buf + i, min(len - i, 16u));
+	for (i = 0; i < len && d->state != FD_DONE; i++) {
+		c = buf[i];
+		if (c == f->delim) {
+			if (d->state == FD_ESC)
+				frame_bad_escape(c);
+			/* Back-to-back delimiters delimit empty frames */
+			if (d->out)
+				frame_close();
+			else
+				d->state = FD_DATA;
+			continue;
+		}
+
+		switch (d->state) {
+		case FD_IDLE:
+			pr_error("Lost opening delimiter\n");
+			frame_lost_delims++;
+			d->bad = 1;
+			d->state = FD_DATA;
+			/* fall through */
+		case FD_DATA:
+			if (c == f->esc)
+				d->state = FD_ESC;
+			else
+				frame_emit(c);
+			break;
+		case FD_ESC:
+			if (f->dec[c])
+				frame_emit(f->dec[c]);
+			else
+				frame_bad_escape(c);
+			d->state = FD_DATA;
+			break;
+		case FD_DONE:
+			break;
+		}
+	}
 }
 
-static int cmp_line(unsigned int address, const unsigned char *buf1,
-		    const unsigned char *buf2, unsigned int len)
+static void cobs_decode(const struct framing *f, const unsigned char *buf,
+			unsigned int len)
 {
+	struct frame_dec *d = &frame_dec;
 	unsigned int i;
 	unsigned char c;
-	int res = 0;
 
-	pr_info("%04x:", address);
-
-	for (i = 0; i < len; i++)
-		if (buf1[i] == buf2[i]) {
-			printf(" %02x", buf1[i]);
+	for (i = 0; i < len && d->state != FD_DONE; i++) {
+		c = buf[i];
+		if (!c) {
+			/* A delimiter inside a block means its code was bad */
+			if (d->block)
+				frame_bad_escape(c);
+			frame_close();
+		} else if (d->block) {
+			frame_emit(c);
+			d->block--;
 		} else {
-			printf(" " ESC_RED "%02x" ESC_RM, buf1[i]);
-			res++;
+			/* Blocks shorter than the maximum imply a zero */
+			if (d->zero)
+				frame_emit(0);
+			d->block = c - 1;
+			d->zero = c != 0xff;
 		}
-	for (i = len; i < 16; i++)
-		printf("   ");
-
-	printf(" |");
-	for (i = 0; i < len; i++) {
-		c = buf1[i] >= 32 && buf1[i] < 127 ? buf1[i] : '.';
-		if (buf1[i] == buf2[i])
-			putchar(c);
-		else
-			printf(ESC_RED "%c" ESC_RM, c);
 	}
-	puts("|");
-	return res;
 }
 
-static void cmp_buffer(const void *buf1, const void *buf2, unsigned int len)
+static const struct framing framings[] = {
+	{
+		.name = "slip",
+		.delim = 0xc0, .esc = 0xdb, .opening = 1,
+		.enc = { [0xc0] = 0xdc, [0xdb] = 0xdd },
+		.dec = { [0xdc] = 0xc0, [0xdd] = 0xdb },
+		.encode = stuff_encode,
+		.decode = stuff_decode,
+	}, {
+		.name = "cobs",
+		.encode = cobs_encode,
+		.decode = cobs_decode,
+	}, {
+		.name = "hdlc",
+		.delim = 0x7e, .esc = 0x7d, .opening = 1,
+		.enc = { [0x7e] = 0x5e, [0x7d] = 0x5d },
+		.dec = { [0x5e] = 0x7e, [0x5d] = 0x7d },
+		.encode = stuff_encode,
+		.decode = stuff_decode,
+	},
+};
+
+static void frame_dec_start(const struct msg *msg)
 {
-	unsigned int i;
+	memset(&frame_dec, 0, sizeof(frame_dec));
+	frame_dec.msg = msg;
+	frame_dec.state = opt_framing->opening ? FD_IDLE : FD_DATA;
+}
 
-	for (i = 0; i < len; i += 16) {
-		if (!cmp_line(i, buf1 + i, buf2 + i, min(len - i, 16u)))
-			continue;
-		pr_info("Expected:\n");
-		print_line(i, buf2 + i, min(len - i, 16u));
+/* Feed received bytes to the decoder, as they are read */
+static void frame_feed(const unsigned char *buf, unsigned int len)
+{
+	if (opt_framing)
+		opt_framing->decode(opt_framing, buf, len);
+}
+
+static void frame_dec_end(void)
+{
+	struct frame_dec *d = &frame_dec;
+
+	frame_raw_bytes += d->msg->len;
+	frame_plain_bytes += d->msg->plain_len;
+
+	/*
+	 * Without the closing delimiter, the frame only lost it if all of its
+	 * payload arrived.  Otherwise reception ended early on lost or bad data,
+	 * which the byte-level results already report.
+	 */
+	if (d->state != FD_DONE && d->out == d->msg->plain_len) {
+		pr_error("Lost closing delimiter\n");
+		frame_lost_delims++;
+		d->bad = 1;
+	}
 
+	if (d->bad) {
+		frames_bad++;
+	} else if (d->state != FD_DONE) {
+		pr_debug("Frame truncated at %u of %u bytes\n", d->out,
+			 d->msg->plain_len);
+		frames_truncated++;
+	} else {
+		frames_ok++;
+		frame_good_bytes += d->msg->plain_len;
 	}
 }
 
-static void msg_dump(const struct msg *msg)
+/*
+ * Add len bytes at message offset to a sum of little-endian 64-bit words.
+ * The aligned middle is summed word by word, which the compiler vectorizes.
+ */
+static uint64_t word_sum(uint64_t sum, const unsigned char *buf,
+			 unsigned int offset, unsigned int len)
 {
-	pr_info("Message with %u bytes of data\n", msg->len);
-	print_buffer(msg->buf, msg->len);
+	uint64_t w, s[4] = { 0 };
+	unsigned int i, j, n;
+
+	for (; len && (offset & 7); buf++, offset++, len--)
+		sum += (uint64_t)*buf << 8 * (offset & 7);
+
+	/* Independent partial sums, to keep several vector adds in flight */
+	n = len - len % sizeof(s);
+	for (i = 0; i < n; i += sizeof(s)) {
+		for (j = 0; j < 4; j++) {
+			memcpy(&w, buf + i + j * sizeof(w), sizeof(w));
+			s[j] += le64toh(w);
+		}
+	}
+	for (j = 0; j < 4; j++)
+		sum += s[j];
+
+	for (; i < len; i++)
+		sum += (uint64_t)buf[i] << 8 * (i & 7);
+
+	return sum;
 }
 
-static void signal_handler(int signum)
+static uint32_t block_fold(uint64_t sum)
 {
-	print_stats();
-	exit(-1);
+	return sum ^ sum >> 32;
 }
 
-static struct sigaction signal_action = {
+static unsigned int digest_blocks(unsigned int len)
+{
+	if (opt_verify != VERIFY_HASH)
+		return 0;
+
+	return (len + opt_verify_n - 1) / opt_verify_n;
+}
+
+/* Precompute the expected values for reduced verification */
+static void msg_digest(struct msg *msg, uint32_t *hashes)
+{
+	unsigned int i, n, k, blk = msg->rxlen;
+	uint64_t s, sum = 0;
+
+	if (opt_verify == VERIFY_FULL)
+		return;
+
+	/* One pass, the stream sum is the sum of the block sums */
+	if (opt_verify == VERIFY_HASH)
+		blk = opt_verify_n;
+	for (i = 0, k = 0; i < msg->rxlen; i += n, k++) {
+		n = min(blk, msg->rxlen - i);
+		s = word_sum(0, msg->data + i, i, n);
+		if (opt_verify == VERIFY_HASH)
+			hashes[k] = block_fold(s);
+		sum += s;
+	}
+
+	msg->hashes = hashes;
+	msg->sum = sum;
+	msg->digest = 1;
+}
+
+static struct msg *msg_gen(int len)
+{
+	unsigned int i, size;
+	struct msg *msg;
+
+	if (len < 0)
+		len = brahe_prng_range(&prng, 1, -len);
+
+	/*
+	 * Frames are encoded behind the plain data, and may double in size.
+	 * Block sums follow, aligned.
+	 */
+	size = ((opt_framing ? 3 * len + 2 : len) + 3) & ~3;
+	msg = malloc(sizeof(*msg) + size +
+		     digest_blocks(size) * sizeof(*msg->hashes));
+	memset(msg, 0, sizeof(*msg));
+
+	msg->len = len;
+	msg->data = msg->buf;
+	for (i = 0; i < len; i++)
+		msg->buf[i] = brahe_prng_next(&prng);
+
+	if (opt_framing) {
+		/* Frames are always received completely */
+		msg->plain = msg->buf;
+		msg->plain_len = len;
+		msg->data = msg->buf + len;
+		msg->len = opt_framing->encode(opt_framing, msg->buf, len,
+					       msg->buf + len);
+		msg->brk = -1;
+		msg->rxlen = msg->len;
+		msg_digest(msg, (uint32_t *)(msg->buf + size));
+		return msg;
+	}
+
+	msg_set_break(msg);
+	msg->rxlen = msg->brk >= 0 ? len : brahe_prng_range(&prng, 1, len);
+	msg_digest(msg, (uint32_t *)(msg->buf + size));
+
+	return msg;
+}
+
+static void payload_map_file(const char *pathname)
+{
+	struct stat st;
+	void *map;
+
+	payload_fd = open(pathname, O_RDONLY);
+	if (payload_fd < 0) {
+		pr_error("Failed to open %s: %s\n", pathname, strerror(errno));
+		exit(-1);
+	}
+
+	if (fstat(payload_fd, &st)) {
+		pr_error("Failed to stat %s: %s\n", pathname, strerror(errno));
+		exit(-1);
+	}
+	if (!S_ISREG(st.st_mode) || !st.st_size || st.st_size > UINT_MAX) {
+		pr_error("%s is not a regular file of a supported size\n",
+			 pathname);
+		exit(-1);
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, payload_fd, 0);
+	if (map == MAP_FAILED) {
+		pr_error("Failed to map %s: %s\n", pathname, strerror(errno));
+		exit(-1);
+	}
+
+	payload_map = map;
+	payload_size = st.st_size;
+	pr_debug("Mapped %zu bytes of payload from %s\n", payload_size,
+		 pathname);
+
+	/* The payload never changes, so digest it once */
+	if (opt_verify != VERIFY_FULL) {
+		struct msg msg = {
+			.data = payload_map,
+			.rxlen = payload_size,
+		};
+
+		payload_hashes = malloc(digest_blocks(payload_size) *
+					sizeof(*payload_hashes));
+		msg_digest(&msg, payload_hashes);
+		payload_sum = msg.sum;
+	}
+}
+
+/*
+ * Payload messages carry no copy of the data: the transmitter sends straight
+ * from the file, and the receiver verifies against the mapping
+ */
+static struct msg *msg_payload(void)
+{
+	struct msg *msg;
+
+	msg = malloc(sizeof(*msg));
+	memset(msg, 0, sizeof(*msg));
+
+	msg->len = payload_size;
+	msg->data = payload_map;
+
+	/* Payload files are always received completely */
+	msg_set_break(msg);
+	msg->rxlen = msg->len;
+	if (opt_verify != VERIFY_FULL) {
+		msg->digest = 1;
+		msg->hashes = payload_hashes;
+		msg->sum = payload_sum;
+	}
+
+	return msg;
+}
+
+static void hist_summary(const char *name, const struct hist *h)
+{
+	if (!h->count) {
+		pr_info("%s: no samples\n", name);
+		return;
+	}
+
+	pr_info("%s: n %llu, min %.1f, avg %.1f, max %.1f µs, "
+		"p50 %.1f, p90 %.1f, p99 %.1f µs\n", name, h->count,
+		h->min / 1e3, h->sum / 1e3 / h->count, h->max / 1e3,
+		hist_percentile(h, 50) / 1e3, hist_percentile(h, 90) / 1e3,
+		hist_percentile(h, 99) / 1e3);
+}
+
+static void hist_print(const char *name, const struct hist *h)
+{
+	unsigned long long peak = 0;
+	unsigned int i, first, last;
+
+	hist_summary(name, h);
+	if (!h->count)
+		return;
+
+	first = hist_index(h->min);
+	last = hist_index(h->max);
+	for (i = first; i <= last; i++)
+		peak = max(peak, h->bucket[i]);
+
+	for (i = first; i <= last; i++)
+		if (h->bucket[i])
+			pr_info("  %10.1f µs %10llu %.*s\n", hist_lower(i) / 1e3,
+			h->bucket[i], (int)(h->bucket[i] * 50 / peak),
+			"##################################################");
+}
+
+static void print_err_stats(void)
+{
+	unsigned int i, j;
+
+	pr_info("Errors by message length:\n");
+	for (i = 0; i < LEN_BUCKETS; i++)
+		if (len_msgs[i])
+			pr_info("  %5u-%-5u bytes: %u/%u messages\n", 1U << i,
+				(2U << i) - 1, len_errors[i], len_msgs[i]);
+
+	for (i = 0; i < opt_nerr_mods; i++) {
+		pr_info("First error offset modulo %u:\n", opt_err_mods[i]);
+		for (j = 0; j < opt_err_mods[i]; j++)
+			if (err_mod_hist[i][j])
+				pr_info("  %5u: %u\n", j, err_mod_hist[i][j]);
+	}
+}
+
+static void print_flush_stats(void)
+{
+	unsigned int i;
+
+	hist_summary("RX flush", &flush_hist);
+	pr_warn("Flush leaks: %u of %u messages, %llu bytes (max %u), of %llu unconsumed bytes\n",
+		flush_leaks, flush_msgs, flush_leaked, flush_leak_max,
+		flush_unconsumed);
+	pr_info("Flush leaks by previous message length:\n");
+	for (i = 0; i < LEN_BUCKETS; i++)
+		if (flush_len_msgs[i])
+			pr_info("  %5u-%-5u bytes: %u/%u messages, %llu bytes\n",
+				1U << i, (2U << i) - 1, flush_len_leaks[i],
+				flush_len_msgs[i], flush_len_leaked[i]);
+}
+
+static void print_receivers(void)
+{
+	char name[64];
+	unsigned int i;
+
+	for (i = 0; i < nreceivers; i++) {
+		pr_warn("%s: %u messages, %u failed, %llu bytes\n",
+			receivers[i].pathname, receivers[i].msgs,
+			receivers[i].failures, receivers[i].bytes);
+		snprintf(name, sizeof(name), "%s latency",
+			 receivers[i].pathname);
+		hist_summary(name, &receivers[i].lat);
+	}
+	hist_summary("RX completion skew", &rx_skew_hist);
+}
+
+static void print_frame_stats(void)
+{
+	double elapsed = (now_ns() - run_start) / 1e9;
+
+	if (!frame_plain_bytes)
+		return;
+
+	pr_warn("Framing %s: %u frames OK, %u bad, %u truncated by data loss, %llu raw bytes for %llu payload bytes (%.1f%% overhead)\n",
+		opt_framing->name, frames_ok, frames_bad, frames_truncated,
+		frame_raw_bytes, frame_plain_bytes,
+		(frame_raw_bytes - frame_plain_bytes) * 100.0 / frame_plain_bytes);
+	pr_warn("Framing throughput: raw %.1f bytes/s, payload %.1f bytes/s\n",
+		rx_bytes / elapsed, frame_good_bytes / elapsed);
+	if (frames_bad)
+		pr_warn("Framing errors: %u bad escapes, %u lost delimiters, %u length errors, %u payload mismatches\n",
+			frame_bad_escapes, frame_lost_delims, frame_len_errors,
+			frame_mismatches);
+}
+
+static void print_cpu_cost(void)
+{
+	unsigned long long total = 0;
+	unsigned int i;
+
+	pr_info("CPU cost per thread:\n");
+	for (i = 0; i < CPU_ROLES; i++) {
+		const struct cpu_cost *c = &cpu_cost[i];
+
+		if (!c->user && !c->sys && !c->nvcsw && !c->nivcsw)
+			continue;
+		total += c->user + c->sys;
+		pr_info("  %-4s: user %.3f ms, sys %.3f ms, %llu voluntary, %llu involuntary switches\n",
+			cpu_role_names[i], c->user / 1e6, c->sys / 1e6,
+			c->nvcsw, c->nivcsw);
+		if (c->perf[PERF_CYCLES])
+			pr_info("        %llu cycles, %llu instructions, IPC %.2f\n",
+				c->perf[PERF_CYCLES], c->perf[PERF_INSTRUCTIONS],
+				(double)c->perf[PERF_INSTRUCTIONS] /
+				c->perf[PERF_CYCLES]);
+	}
+
+	if (msgs)
+		pr_warn("CPU: %.1f µs per message, %.1f µs per KiB\n",
+			total / 1e3 / msgs,
+			tx_bytes ? total / 1e3 / (tx_bytes / 1024.0) : 0);
+	hist_summary("CPU per message", &cpu_msg_hist);
+}
+
+static void print_port(const char *pathname, const struct port *port)
+{
+	const struct serial_struct *ss = &port->ss;
+	char type[16];
+
+	if (!port->valid)
+		return;
+
+	if (ss->type >= 0 && ss->type <= PORT_MAX)
+		snprintf(type, sizeof(type), "%s", port_types[ss->type]);
+	else
+		snprintf(type, sizeof(type), "type %d", ss->type);
+
+	pr_info("%s: %s, FIFO %d bytes, baud_base %d, flags 0x%x\n",
+		pathname, type, ss->xmit_fifo_size, ss->baud_base, ss->flags);
+}
+
+static void print_stats(void)
+{
+	print_port(opt_txdev, &tx_port);
+	print_port(opt_rxdev, &rx_port);
+	pr_warn("MSG: %u, TX: %llu bytes, RX: %llu bytes\n", msgs, tx_bytes,
+		rx_bytes);
+	if (rx_failures)
+		pr_warn("Failed messages: %u\n", rx_failures);
+	if (opt_duration || opt_rate) {
+		double elapsed = (now_ns() - run_start) / 1e9;
+
+		pr_warn("Elapsed: %.3f s, %.1f msgs/s, %.1f bytes/s\n",
+			elapsed, msgs / elapsed, tx_bytes / elapsed);
+	}
+	if (opt_keep_going)
+		print_err_stats();
+	if (nreceivers > 1)
+		print_receivers();
+	if (opt_verify != VERIFY_FULL && verify_received) {
+		pr_warn("Verify %s: checked %llu of %llu received bytes (%.1f%%)\n",
+			verify_modes[opt_verify], verify_checked,
+			verify_received,
+			verify_checked * 100.0 / verify_received);
+		if (verify_sum_only)
+			pr_warn("Errors only caught by the stream sum: %u\n",
+				verify_sum_only);
+	}
+	if (opt_flush_probe)
+		print_flush_stats();
+	if (opt_framing)
+		print_frame_stats();
+	if (nloads) {
+		static const char * const names[] = { "Idle", "Loaded" };
+		char name[32];
+		unsigned int i;
+
+		for (i = 0; i < 2; i++) {
+			pr_warn("%s: %u messages, %u failed\n", names[i],
+				phase_stats[i].msgs, phase_stats[i].failures);
+			snprintf(name, sizeof(name), "%s latency", names[i]);
+			hist_summary(name, &phase_stats[i].lat);
+		}
+	}
+	if (opt_cpu_cost)
+		print_cpu_cost();
+	if (irq_msgs) {
+		unsigned int i;
+
+		pr_warn("IRQ %s: %llu interrupts, %.2f per message (min %llu, max %llu)\n",
+			irq_label, irq_total, (double)irq_total / irq_msgs,
+			irq_msg_min, irq_msg_max);
+		if (rx_bytes)
+			pr_warn("IRQ %s: %.4f interrupts per received byte\n",
+				irq_label, (double)irq_total / rx_bytes);
+		for (i = 0; i < irq_ncpus; i++)
+			if (irq_cpu[i])
+				pr_info("  CPU%u: %llu\n", i, irq_cpu[i]);
+	}
+	if (opt_verify_thread)
+		pr_warn("Verify ring: max depth %llu of %u bytes, %llu stalls\n",
+			verify_max_depth, VERIFY_RING_SIZE, verify_stalls);
+	if (opt_qsample)
+		pr_warn("Max queued: TX: %u bytes, RX: %u bytes\n", max_outq,
+			max_inq);
+	if (opt_break >= 0)
+		pr_warn("Breaks: sent %u, counted %u\n", breaks_sent,
+			breaks_counted);
+	if (opt_rs485) {
+		hist_print("RS-485 end of write to transmitter empty",
+			   &rs485_drain_hist);
+		hist_print("RS-485 transmitter empty to bus release",
+			   &rs485_release_hist);
+		if (rs485_unobserved)
+			pr_warn("RS-485 bus release not observable for %u messages\n",
+				rs485_unobserved);
+	}
+	if (opt_pingpong) {
+		char name[32];
+		unsigned int i;
+
+		for (i = 0; i < LEN_BUCKETS; i++) {
+			if (!rtt_hist[i].count)
+				continue;
+			snprintf(name, sizeof(name), "RTT %u-%u bytes", 1U << i,
+				 (2U << i) - 1);
+			hist_print(name, &rtt_hist[i]);
+		}
+	}
+	if (opt_period) {
+		hist_print("TX start after slot", &period_tx_hist);
+		hist_print("RX completion after slot", &period_rx_hist);
+		pr_info("RX jitter (max - min): %.1f µs\n",
+			(period_rx_hist.max - period_rx_hist.min) / 1e3);
+		if (period_overruns)
+			pr_warn("Missed slots: %u\n", period_overruns);
+	}
+	if (opt_open_bench) {
+		char name[64];
+		unsigned int i;
+
+		for (i = 0; i < OPEN_STEPS; i++) {
+			snprintf(name, sizeof(name), "%s %s", opt_txdev,
+				 open_step_names[i]);
+			hist_print(name, &tx_open_prof[i]);
+		}
+		for (i = 0; i < OPEN_STEPS; i++) {
+			snprintf(name, sizeof(name), "%s %s", opt_rxdev,
+				 open_step_names[i]);
+			hist_print(name, &rx_open_prof[i]);
+		}
+	}
+	if (opt_modem) {
+		pr_warn("Modem line changes: %u, errors: %u\n", msgs,
+			modem_errors);
+		hist_print("Line change latency", &modem_hist);
+	}
+}
+
+static void print_line(unsigned int index, const unsigned char *buf,
+		       unsigned int len)
+{
+	unsigned int i;
+
+	pr_info("%04x:", index);
+
+	for (i = 0; i < len; i++)
+		printf(" %02x", buf[i]);
+	for (i = len; i < 16; i++)
+		printf("   ");
+
+	printf(" |");
+	for (i = 0; i < len; i++)
+		putchar(buf[i] >= 32 && buf[i] < 127 ? buf[i] : '.');
+	puts("|");
+}
+
+static void print_buffer(const void *buf, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i += 16)
+		print_line(i, buf + i, min(len - i, 16u));
+}
+
+static int cmp_line(unsigned int address, const unsigned char *buf1,
+		    const unsigned char *buf2, unsigned int len)
+{
+	unsigned int i;
+	unsigned char c;
+	int res = 0;
+
+	pr_info("%04x:", address);
+
+	for (i = 0; i < len; i++)
+		if (buf1[i] == buf2[i]) {
+			printf(" %02x", buf1[i]);
+		} else {
+			printf(" " ESC_RED "%02x" ESC_RM, buf1[i]);
+			res++;
+		}
+	for (i = len; i < 16; i++)
+		printf("   ");
+
+	printf(" |");
+	for (i = 0; i < len; i++) {
+		c = buf1[i] >= 32 && buf1[i] < 127 ? buf1[i] : '.';
+		if (buf1[i] == buf2[i])
+			putchar(c);
+		else
+			printf(ESC_RED "%c" ESC_RM, c);
+	}
+	puts("|");
+	return res;
+}
+
+static void cmp_buffer(unsigned int address, const void *buf1,
+		       const void *buf2, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i += 16) {
+		if (!cmp_line(address + i, buf1 + i, buf2 + i,
+			      min(len - i, 16u)))
+			continue;
+		pr_info("Expected:\n");
+		print_line(address + i, buf2 + i, min(len - i, 16u));
+
+	}
+}
+
+static void msg_dump(const struct msg *msg)
+{
+	pr_info("Message with %u bytes of data\n", msg->len);
+	print_buffer(msg->data, msg->len);
+}
+
+static void signal_handler(int signum)
+{
+	print_stats();
+	exit(-1);
+}
+
+static struct sigaction signal_action = {
 	.sa_handler = signal_handler,
 };
 
@@ -310,25 +1533,92 @@ static void __attribute__ ((noreturn)) usage(void)
 {
 	fprintf(stderr,
 		"\n"
-		"%s: [options] <txdev> <rxdev>\n\n"
+		"%s: [options] <txdev> <rxdev> [<rxdev>...]\n\n"
 		"Valid options are:\n"
+		"    --baseline       Compare the results against a saved baseline file\n"
+		"    --break          Inject a break of n ms into each message (zero uses tcsendbreak())\n"
+		"    --break-at       Offset of the injected break (default random)\n"
+		"    --characterize   Characterize FIFO depth and trigger level using bursts of 1..n bytes\n"
+		"    --cpu-cost       Account the CPU time and context switches of each thread\n"
+		"    --duration       Stop after n seconds\n"
+		"    --echo           Act as echo responder for --pingpong\n"
+		"    --err-mod        Bucket error offsets modulo n[,n...] (default %u)\n"
+		"    -f, --file       Transmit the contents of a payload file\n"
+		"    --flush-probe    Time the rx flush, and probe for bytes surviving it for n µs\n"
+		"    --framing        Wrap messages in <slip|cobs|hdlc> frames, and decode them\n"
+		"    --gap            Idle gap between messages in µs, or <min>-<max> for random (default zero)\n"
 		"    -h, --help       Display this usage information\n"
 		"    -i, --seed       Initial seed (zero is pseudorandom)\n"
+		"    --irq            Account interrupts of an IRQ number or name, or auto (from rxdev)\n"
+		"    -k, --keep-going Continue after errors, and report error statistics\n"
+		"    --latency-sweep  Sweep the USB serial latency_timer, measuring latency and throughput\n"
+		"    --latency-timer  Set the USB serial latency_timer in ms (restored on exit)\n"
 		"    -l, --len        Maximum message length (default %u, must be <= %u)\n"
+		"    --load           Add background load <cpu|mem|cache|syscall>[:threads[:duty%%]][@cpu]\n"
+		"    --load-phase     Alternate idle and loaded phases every n messages (default %u)\n"
+		"    --modem          Benchmark modem line changes (rts->cts, dtr->dsr)\n"
 		"    -n               Number of messages to send (default zero is unlimited)\n"
+		"    --open-bench     Profile opening and closing the devices (-n times)\n"
+		"    --period         Send a frame of --len bytes every n µs, measuring jitter\n"
+		"    --perf           Like --cpu-cost, also counting cycles and instructions\n"
+		"    --pingpong       Measure round-trip times against an echo responder\n"
+		"    --prefetch       Generate up to n messages ahead in a separate thread (n <= %u)\n"
+		"    --qsample        Sample kernel tx/rx queue levels every n µs\n"
+		"    --qlog           Write queue samples to a file\n"
+		"    --rate           Send at most n messages/s, or n bytes/s with a B suffix\n"
+		"    --rs485          Enable RS-485 on txdev, with RTS delays <before>,<after> in ms\n"
+		"    --save-baseline  Save the results to a baseline file\n"
 		"    -s, --speed      Serial speed\n"
+		"    --search         Search the error-free speed, length, and gap envelope\n"
+		"    --search-window  Messages per search step (default %u)\n"
+		"    --tolerance      Allowed regression in %%, or <metric>=<pct> (default %u)\n"
 		"    -v, --verbose    Enable verbose mode\n"
+		"    --verify         Verify <full|hash[:block]|sample[:n]|random[:n]> (default full, %u, %u)\n"
+		"    --verify-thread  Verify in a separate thread, so reception never stalls\n"
 		"\n",
-		getprogname(), DEFAULT_MAX_MSG_LEN, MAX_MAX_MSG_LEN);
+		getprogname(), DEFAULT_ERR_MOD, DEFAULT_MAX_MSG_LEN,
+		MAX_MAX_MSG_LEN, LOAD_PHASE, MAX_LIST_SIZE, SEARCH_WINDOW,
+		DEFAULT_TOLERANCE, DEFAULT_HASH_BLOCK, DEFAULT_SAMPLE_STEP);
 	exit(1);
 }
 
-static int device_open(const char *pathname, int flags, int makeraw)
+static void open_step(enum open_step step, uint64_t *t)
+{
+	uint64_t now;
+
+	if (!open_prof)
+		return;
+
+	now = now_ns();
+	hist_add(&open_prof[step], now - *t);
+	*t = now;
+}
+
+static void port_probe(int fd, const char *pathname)
+{
+	struct port *port = pathname == opt_txdev ? &tx_port : &rx_port;
+
+	if (port->probed)
+		return;
+
+	port->probed = 1;
+	port->valid = !ioctl(fd, TIOCGSERIAL, &port->ss);
+	if (port->valid)
+		pr_debug("%s: type %d, xmit_fifo_size %d, baud_base %d, flags 0x%x\n",
+			 pathname, port->ss.type, port->ss.xmit_fifo_size,
+			 port->ss.baud_base, port->ss.flags);
+}
+
+/* Open a device, returning how long its raw mode flush took in *flush_ns */
+static int device_open_flush(const char *pathname, int flags, int makeraw,
+			     uint64_t *flush_ns)
 {
 	struct termios termios;
+	uint64_t t, flush;
 	int fd;
 
 	pr_debug("Trying to open %s...\n", pathname);
+	t = now_ns();
 	fd = open(pathname, flags);
 	if (fd < 0) {
 		pr_error("Failed to open %s%s: %s\n", pathname,
@@ -337,6 +1627,9 @@ static int device_open(const char *pathname, int flags, int makeraw)
 			 strerror(errno));
 		exit(-1);
 	}
+	open_step(OPEN_OPEN, &t);
+
+	port_probe(fd, pathname);
 
 	if (!makeraw)
 		return fd;
@@ -351,16 +1644,20 @@ static int device_open(const char *pathname, int flags, int makeraw)
 			 strerror(errno));
 		exit(-1);
 	}
+	open_step(OPEN_TCGETATTR, &t);
 	pr_debug("termios.c_iflag = 0%o\n", termios.c_iflag);
 	pr_debug("termios.c_oflag = 0%o\n", termios.c_oflag);
 	pr_debug("termios.c_cflag = 0%o\n", termios.c_cflag);
 	pr_debug("termios.c_lflag = 0%o\n", termios.c_lflag);
 
+	if (open_prof)
+		t = now_ns();
 	cfmakeraw(&termios);
 	if (tcsetattr(fd, TCSANOW, &termios)) {
 		pr_error("Failed to enable raw mode: %s\n", strerror(errno));
 		exit(-1);
 	}
+	open_step(OPEN_TCSETATTR, &t);
 
 	if (opt_speed) {
 		int sym = get_speed_sym(opt_speed);
@@ -379,86 +1676,2171 @@ static int device_open(const char *pathname, int flags, int makeraw)
 				 strerror(errno));
 			exit(-1);
 		}
+		open_step(OPEN_CFSETSPEED, &t);
 	} else {
 		pr_debug("Serial speed is %u/%u\n",
 			 get_speed_val(cfgetispeed(&termios)),
 			 get_speed_val(cfgetospeed(&termios)));
+		if (open_prof)
+			t = now_ns();
 	}
 
+	flush = now_ns();
 	if (tcflush(fd, TCIOFLUSH)) {
 		pr_error("Failed to flush: %s\n", strerror(errno));
 		exit(-1);
 	}
+	if (flush_ns)
+		*flush_ns = now_ns() - flush;
+	open_step(OPEN_TCFLUSH, &t);
 
 	return fd;
 }
 
-static void *transmit_start(void *arg)
+static int device_open(const char *pathname, int flags, int makeraw)
 {
-	int fd = device_open(opt_txdev, O_WRONLY, 1);
-	struct msg *msg = arg;
-	ssize_t res;
+	return device_open_flush(pathname, flags, makeraw, NULL);
+}
 
-	if (opt_verbose)
-		msg_dump(msg);
+/*
+ * Poll the kernel tx and rx queue levels at a fixed rate while a message is
+ * in flight.  The descriptors may be closed under our feet, which is harmless
+ * as the ioctls just fail then.
+ */
+static void *qsample_start(void *arg)
+{
+	uint64_t start = now_ns(), next = start;
+	struct qsample *qs;
+	struct timespec ts;
+	int fd, val;
 
-	res = write(fd, msg->buf, msg->len);
-	if (res < 0) {
-		pr_error("Write error %d\n", errno);
-		exit(-1);
-	}
-	tx_bytes += res;
+	nqsamples = 0;
+	while (qsampling && nqsamples < MAX_QSAMPLES) {
+		qs = &qsamples[nqsamples];
+		qs->t_us = (now_ns() - start) / 1000;
+		qs->outq = qs->inq = 0;
 
-	if (res < msg->len) {
-		pr_error("Short write %zd < %u\n", res, msg->len);
-		exit(-1);
-	}
+		fd = tx_fd;
+		if (fd >= 0 && !ioctl(fd, TIOCOUTQ, &val))
+			qs->outq = val;
+		fd = rx_fd;
+		if (fd >= 0 && !ioctl(fd, TIOCINQ, &val))
+			qs->inq = val;
 
-	close(fd);
+		nqsamples++;
+
+		next += opt_qsample * 1000ULL;
+		ns_to_timespec(next, &ts);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
 
 	return NULL;
 }
 
-static void *receive_start(void *arg)
+static void qsample_flush(void)
 {
-	int fd = device_open(opt_rxdev, O_RDONLY, 1);
-	static unsigned char buf[MAX_MAX_MSG_LEN];
-	unsigned int avail = 0, len;
-	struct msg *msg = arg;
-	ssize_t res;
+	unsigned int i, outq = 0, inq = 0;
+	const struct qsample *qs;
 
-	len = brahe_prng_range(&prng, 1, msg->len);
-	pr_debug(ESC_GREEN "Receiving first %u bytes of message of size %u\n",
-		 len, msg->len);
-
-	while (avail < len) {
-		res = read(fd, buf + avail, len - avail);
-		if (res < 0) {
-			pr_error("Read error %d\n", errno);
-			exit(-1);
-		}
-		avail += res;
-		rx_bytes += res;
+	for (i = 0; i < nqsamples; i++) {
+		qs = &qsamples[i];
+		outq = max(outq, qs->outq);
+		inq = max(inq, qs->inq);
+		if (qlog)
+			fprintf(qlog, "%u %u %u %u\n", msgs, qs->t_us,
+				qs->outq, qs->inq);
 	}
 
-	if (memcmp(buf, msg->buf, len)) {
-		pr_error("Data mismatch\n");
-		cmp_buffer(buf, msg->buf, len);
+	pr_debug("%u queue samples, max queued: TX: %u bytes, RX: %u bytes\n",
+		 nqsamples, outq, inq);
+	max_outq = max(max_outq, outq);
+	max_inq = max(max_inq, inq);
+}
+
+static void modem_prepare(int fd)
+{
+	struct termios termios;
+
+	/* Hardware flow control would make the driver drive RTS itself */
+	if (tcgetattr(fd, &termios))
+		return;
+	termios.c_cflag &= ~CRTSCTS;
+	termios.c_cflag |= CLOCAL;
+	if (tcsetattr(fd, TCSANOW, &termios)) {
+		pr_error("Failed to disable flow control: %s\n",
+			 strerror(errno));
+		exit(-1);
+	}
+}
+
+static volatile int modem_waiting;
+static uint64_t modem_seen;
+
+static void *modem_wait_start(void *arg)
+{
+	int fd = *(int *)arg;
+
+	modem_waiting = 1;
+	if (ioctl(fd, TIOCMIWAIT, opt_modem->in)) {
+		pr_error("Failed to wait for modem line change: %s\n",
+			 strerror(errno));
+		exit(-1);
+	}
+	modem_seen = now_ns();
+
+	return NULL;
+}
+
+/*
+ * Toggle an output modem control line on txdev, and measure how long it takes
+ * until the change is reported on the corresponding input line of rxdev
+ */
+static void modem_bench(void)
+{
+	int txfd = device_open(opt_txdev, O_WRONLY, 1);
+	int rxfd = device_open(opt_rxdev, O_RDONLY, 1);
+	struct timespec timeout, settle = { .tv_nsec = MODEM_SETTLE_US * 1000 };
+	int level = 0, status;
+	uint64_t start;
+
+	modem_prepare(txfd);
+	modem_prepare(rxfd);
+
+	if (ioctl(txfd, TIOCMBIC, &opt_modem->out)) {
+		pr_error("Failed to clear modem line: %s\n", strerror(errno));
+		exit(-1);
+	}
+	nanosleep(&settle, NULL);
+
+	for (msgs = 0; !run_done(); msgs++) {
+		modem_waiting = 0;
+		pthread_create(&rx_thread, NULL, modem_wait_start, &rxfd);
+
+		/* There is no way to tell the waiter has entered the ioctl */
+		while (!modem_waiting)
+			sched_yield();
+		nanosleep(&settle, NULL);
+
+		level = !level;
+		start = now_ns();
+		if (ioctl(txfd, level ? TIOCMBIS : TIOCMBIC, &opt_modem->out)) {
+			pr_error("Failed to toggle modem line: %s\n",
+				 strerror(errno));
+			exit(-1);
+		}
+
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timeout.tv_sec += RX_TIMEOUT;
+		if (pthread_timedjoin_np(rx_thread, NULL, &timeout)) {
+			pr_error("No modem line change seen within %u s\n",
+				 RX_TIMEOUT);
+			print_stats();
+			exit(-1);
+		}
+
+		hist_add(&modem_hist, modem_seen - start);
+
+		if (ioctl(rxfd, TIOCMGET, &status)) {
+			pr_error("Failed to get modem lines: %s\n",
+				 strerror(errno));
+			exit(-1);
+		}
+		if (!(status & opt_modem->in) != !level) {
+			pr_warn("Modem line is %s, expected %s\n",
+				status & opt_modem->in ? "high" : "low",
+				level ? "high" : "low");
+			modem_errors++;
+		}
+		pr_debug("Line change %u: %.1f µs\n", msgs,
+			 (modem_seen - start) / 1e3);
+	}
+
+	close(rxfd);
+	close(txfd);
+}
+
+static uint64_t timeval_ns(const struct timeval *tv)
+{
+	return tv->tv_sec * 1000000000ULL + tv->tv_usec * 1000ULL;
+}
+
+/* Start accounting the CPU usage of the calling thread */
+static void cpu_begin(struct cpu_sample *s)
+{
+	static const unsigned long long configs[PERF_COUNTERS] = {
+		[PERF_CYCLES]		= PERF_COUNT_HW_CPU_CYCLES,
+		[PERF_INSTRUCTIONS]	= PERF_COUNT_HW_INSTRUCTIONS,
+	};
+	struct perf_event_attr attr = {
+		.type = PERF_TYPE_HARDWARE,
+		.size = sizeof(attr),
+		.exclude_hv = 1,
+	};
+	unsigned int i;
+
+	if (!opt_cpu_cost)
+		return;
+
+	for (i = 0; i < PERF_COUNTERS; i++) {
+		s->perf_fd[i] = -1;
+		if (!opt_perf || perf_unavailable)
+			continue;
+		attr.config = configs[i];
+		s->perf_fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+					0);
+		if (s->perf_fd[i] < 0) {
+			perf_unavailable = 1;
+			pr_warn("perf_event_open failed: %s, not counting cycles and instructions\n",
+				strerror(errno));
+		}
+	}
+
+	getrusage(RUSAGE_THREAD, &s->ru);
+}
+
+/*
+ * Account the CPU usage of the calling thread since cpu_begin(), returning
+ * its user and system time in ns
+ */
+static uint64_t cpu_end(struct cpu_sample *s, enum cpu_role role)
+{
+	struct cpu_cost *c = &cpu_cost[role];
+	uint64_t user, sys, val;
+	struct rusage ru;
+	unsigned int i;
+
+	if (!opt_cpu_cost)
+		return 0;
+
+	getrusage(RUSAGE_THREAD, &ru);
+	user = timeval_ns(&ru.ru_utime) - timeval_ns(&s->ru.ru_utime);
+	sys = timeval_ns(&ru.ru_stime) - timeval_ns(&s->ru.ru_stime);
+
+	/* Several receivers may account at the same time */
+	pthread_mutex_lock(&cpu_cost_lock);
+	c->user += user;
+	c->sys += sys;
+	c->nvcsw += ru.ru_nvcsw - s->ru.ru_nvcsw;
+	c->nivcsw += ru.ru_nivcsw - s->ru.ru_nivcsw;
+
+	for (i = 0; i < PERF_COUNTERS; i++) {
+		if (s->perf_fd[i] < 0)
+			continue;
+		if (read(s->perf_fd[i], &val, sizeof(val)) == sizeof(val))
+			c->perf[i] += val;
+		close(s->perf_fd[i]);
+	}
+	pthread_mutex_unlock(&cpu_cost_lock);
+
+	return user + sys;
+}
+
+static void transmit_data(int fd, const struct msg *msg, unsigned int offset,
+			  unsigned int len)
+{
+	off_t pos = offset;
+	ssize_t res;
+
+	while (len) {
+		if (msg->data == payload_map) {
+			/* Zero-copy from the page cache into the tty */
+			res = sendfile(fd, payload_fd, &pos, len);
+		} else {
+			res = write(fd, msg->data + offset, len);
+		}
+		if (res < 0) {
+			pr_error("Write error %d\n", errno);
+			exit(-1);
+		}
+		if (!res) {
+			pr_error("Short write %u < %u\n", offset, msg->len);
+			exit(-1);
+		}
+		tx_bytes += res;
+		offset += res;
+		len -= res;
+	}
+}
+
+static void transmit_break(int fd)
+{
+	struct timespec delay = {
+		.tv_sec = opt_break / 1000,
+		.tv_nsec = (opt_break % 1000) * 1000 * 1000,
+	};
+
+	/* Don't let the break overtake the data before it */
+	if (tcdrain(fd)) {
+		pr_error("Failed to drain: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	if (!opt_break) {
+		if (tcsendbreak(fd, 0)) {
+			pr_error("Failed to send break: %s\n",
+				 strerror(errno));
+			exit(-1);
+		}
+	} else {
+		if (ioctl(fd, TIOCSBRK)) {
+			pr_error("Failed to set break: %s\n", strerror(errno));
+			exit(-1);
+		}
+		nanosleep(&delay, NULL);
+		if (ioctl(fd, TIOCCBRK)) {
+			pr_error("Failed to clear break: %s\n",
+				 strerror(errno));
+			exit(-1);
+		}
+	}
+	breaks_sent++;
+}
+
+static void rs485_restore(void)
+{
+	int fd = open(opt_txdev, O_WRONLY | O_NONBLOCK);
+
+	if (fd < 0 || ioctl(fd, TIOCSRS485, &rs485_saved))
+		pr_error("Failed to restore RS-485 config: %s\n",
+			 strerror(errno));
+	if (fd >= 0)
+		close(fd);
+}
+
+/*
+ * The RS-485 config is a property of the port, not of the open file, so it
+ * only has to be set once, and restored on exit
+ */
+static void rs485_configure(int fd)
+{
+	struct serial_rs485 rs485;
+
+	if (rs485_configured)
+		return;
+
+	if (ioctl(fd, TIOCGRS485, &rs485_saved)) {
+		pr_error("Failed to get RS-485 config: %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	memset(&rs485, 0, sizeof(rs485));
+	rs485.flags = SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND;
+	rs485.delay_rts_before_send = opt_rs485_before;
+	rs485.delay_rts_after_send = opt_rs485_after;
+	if (ioctl(fd, TIOCSRS485, &rs485)) {
+		pr_error("Failed to set RS-485 config: %s\n", strerror(errno));
+		exit(-1);
+	}
+	atexit(rs485_restore);
+	rs485_configured = 1;
+
+	/* The driver may have adjusted unsupported settings */
+	pr_debug("RS-485 flags 0x%x, RTS delays %u/%u ms\n", rs485.flags,
+		 rs485.delay_rts_before_send, rs485.delay_rts_after_send);
+}
+
+/*
+ * Measure the time from the end of the write until the transmitter is empty,
+ * and from there until the driver deasserts RTS, releasing the bus.  The
+ * latter can only be observed if the driver reflects its RS-485 RTS handling
+ * in TIOCMGET.
+ */
+static void rs485_turnaround(int fd)
+{
+	uint64_t start = now_ns(), temt, deadline;
+	int lsr = 0, status, active = 0, res;
+
+	deadline = start + TX_TIMEOUT * 1000000000ULL;
+	while (1) {
+		if (!ioctl(fd, TIOCMGET, &status) && (status & TIOCM_RTS))
+			active = 1;
+		res = ioctl(fd, TIOCSERGETLSR, &lsr);
+		if (res || (lsr & TIOCSER_TEMT))
+			break;
+		if (now_ns() > deadline) {
+			pr_error("Transmitter not empty after %u s\n",
+				 TX_TIMEOUT);
+			exit(-1);
+		}
+	}
+	if (res && tcdrain(fd)) {
+		pr_error("Failed to drain: %s\n", strerror(errno));
+		exit(-1);
+	}
+	temt = now_ns();
+	hist_add(&rs485_drain_hist, temt - start);
+
+	if (!active) {
+		rs485_unobserved++;
+		return;
+	}
+
+	deadline = temt + (opt_rs485_after + RS485_RELEASE_TIMEOUT) *
+			  1000000ULL;
+	while (!ioctl(fd, TIOCMGET, &status) && (status & TIOCM_RTS)) {
+		if (now_ns() > deadline) {
+			rs485_unobserved++;
+			return;
+		}
+	}
+	hist_add(&rs485_release_hist, now_ns() - temt);
+}
+
+static void *transmit_start(void *arg)
+{
+	struct msg *msg = arg;
+	struct cpu_sample cs;
+	uint64_t t;
+	int fd;
+
+	cpu_begin(&cs);
+	t = now_ns();
+	fd = device_open(opt_txdev, O_WRONLY, 1);
+	tx_fd = fd;
+
+	if (opt_rs485)
+		rs485_configure(fd);
+
+	if (opt_verbose)
+		msg_dump(msg);
+
+	msg->tx_start = now_ns();
+	msg->stage[STAGE_TX_OPEN] = msg->tx_start - t;
+	if (msg->brk >= 0) {
+		pr_debug("Sending break at offset %d\n", msg->brk);
+		transmit_data(fd, msg, 0, msg->brk);
+		transmit_break(fd);
+		transmit_data(fd, msg, msg->brk, msg->len - msg->brk);
+	} else {
+		transmit_data(fd, msg, 0, msg->len);
+	}
+
+	t = now_ns();
+	msg->stage[STAGE_TX_WRITE] = t - msg->tx_start;
+
+	if (opt_rs485)
+		rs485_turnaround(fd);
+
+	tx_fd = -1;
+	close(fd);
+	msg->stage[STAGE_TX_CLOSE] = now_ns() - t;
+	msg->cpu[CPU_TX] = cpu_end(&cs, CPU_TX);
+
+	return NULL;
+}
+
+static void err_stats_init(void)
+{
+	unsigned int i;
+
+	if (!opt_nerr_mods)
+		opt_err_mods[opt_nerr_mods++] = DEFAULT_ERR_MOD;
+
+	for (i = 0; i < opt_nerr_mods; i++)
+		err_mod_hist[i] = calloc(opt_err_mods[i],
+					 sizeof(*err_mod_hist[i]));
+}
+
+static void err_record(unsigned int offset)
+{
+	unsigned int i;
+
+	for (i = 0; i < opt_nerr_mods; i++)
+		err_mod_hist[i][offset % opt_err_mods[i]]++;
+}
+
+/*
+ * Receive errors are fatal, unless we are searching for where they start, or
+ * collecting statistics
+ */
+static int receive_failed(void)
+{
+	int fatal = !opt_search && !opt_keep_going;
+
+	if (!rx_collecting || fatal)
+		rx_failures++;
+	if (fatal) {
 		print_stats();
 		exit(-1);
 	}
+	return -1;
+}
+
+static int receive_wait(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	unsigned int timeout = rx_bytes ? RX_TIMEOUT : RX_TIMEOUT_INIT;
+	int res;
+
+	res = poll(&pfd, 1, timeout * 1000);
+	if (res < 0) {
+		pr_error("Poll error %d\n", errno);
+		exit(-1);
+	}
+	if (!res) {
+		pr_error("No data received within %u s\n", timeout);
+		return receive_failed();
+	}
+	return 0;
+}
+
+/*
+ * Return the distance to the next sampled offset: the sampling step, or a
+ * random gap averaging it
+ */
+static unsigned int verify_step(uint32_t *rng)
+{
+	if (opt_verify == VERIFY_SAMPLE)
+		return opt_verify_n;
+
+	/* LCG, scaled by its high bits, for random gaps averaging the step */
+	*rng = *rng * 1664525U + 1013904223U;
+	return 1 + ((uint64_t)*rng * (2 * opt_verify_n - 1) >> 32);
+}
+
+/*
+ * Verify the bytes at offset against the message's precomputed hashes or
+ * samples.  Chunks must arrive in order, and the first rxlen bytes must be
+ * covered to check the stream sum.
+ */
+static int verify_reduced(const struct msg *msg, const unsigned char *buf,
+			  unsigned int offset, unsigned int len)
+{
+	struct verify_state *vs = &verify_state;
+	unsigned int i, n, next, end = offset + len, blk = opt_verify_n;
+	unsigned char diff;
+	uint32_t rng;
+	int failed = 0;
+
+	if (!offset) {
+		memset(vs, 0, offsetof(struct verify_state, seq));
+		/* Sample other offsets in each message, even for one payload */
+		vs->seq++;
+		vs->rng = (opt_seed ^ (uint32_t)msg->sum ^ (msg->sum >> 32) ^
+			   vs->seq * 2654435761U) | 1;
+		if (opt_verify == VERIFY_RANDOM)
+			vs->next = verify_step(&vs->rng) - 1;
+	}
+
+	verify_received += len;
+
+	if (opt_verify == VERIFY_HASH) {
+		for (i = offset; i < end; i += n) {
+			n = min(blk - vs->fill, end - i);
+			vs->block = word_sum(vs->block, buf + i - offset, i, n);
+			vs->fill += n;
+			if (vs->fill < blk && i + n != msg->rxlen)
+				continue;
+			if (block_fold(vs->block) != msg->hashes[vs->idx] &&
+			    !failed) {
+				pr_error("Hash mismatch in block at offset %u\n",
+					 vs->idx * blk);
+				err_record(vs->idx * blk);
+				failed = 1;
+			}
+			vs->sum += vs->block;
+			vs->block = 0;
+			vs->fill = 0;
+			vs->idx++;
+		}
+		verify_checked += len;
+	} else {
+		vs->sum = word_sum(vs->sum, buf, offset, len);
+		/* Branch-free, the mismatch is located by a second pass */
+		next = vs->next;
+		rng = vs->rng;
+		for (n = 0, diff = 0; next < end; n++) {
+			diff |= buf[next - offset] ^ msg->data[next];
+			next += verify_step(&rng);
+		}
+		verify_checked += n;
+		for (; diff; vs->next += verify_step(&vs->rng)) {
+			if (buf[vs->next - offset] == msg->data[vs->next])
+				continue;
+			pr_error("Data mismatch at offset %u\n", vs->next);
+			err_record(vs->next);
+			failed = 1;
+			break;
+		}
+		vs->next = next;
+		vs->rng = rng;
+	}
+
+	if (!failed && end == msg->rxlen && vs->sum != msg->sum) {
+		pr_error("Stream sum mismatch\n");
+		verify_sum_only++;
+		failed = 1;
+	}
+
+	return failed ? receive_failed() : 0;
+}
+
+static void rx_account(unsigned int n)
+{
+	if (rx_self)
+		rx_self->bytes += n;
+	if (!rx_self || rx_self == receivers)
+		rx_bytes += n;
+}
+
+/* Discard the remainder of a failed exchange, once the line has gone quiet */
+static void receive_drain(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	while (poll(&pfd, 1, RX_DRAIN_QUIET) > 0 && (pfd.revents & POLLIN))
+		tcflush(fd, TCIFLUSH);
+	tcflush(fd, TCIFLUSH);
+}
+
+static int verify_data(const struct msg *msg, const unsigned char *buf,
+		       unsigned int offset, unsigned int len)
+{
+	unsigned int i;
+
+	if (msg->digest && offset + len <= msg->rxlen)
+		return verify_reduced(msg, buf, offset, len);
+
+	if (!memcmp(buf, msg->data + offset, len))
+		return 0;
+
+	for (i = 0; buf[i] == msg->data[offset + i]; i++)
+		;
+	pr_error("Data mismatch at offset %u\n", offset + i);
+	err_record(offset + i);
+	if ((!opt_search && !opt_keep_going) || opt_verbose)
+		cmp_buffer(offset, buf, msg->data + offset, len);
+	return receive_failed();
+}
+
+/*
+ * Receive len bytes, and verify them against the expected data at offset
+ */
+static int receive_data(int fd, const struct msg *msg, unsigned int offset,
+			unsigned int len)
+{
+	unsigned char buf[MAX_MAX_MSG_LEN];
+	unsigned int avail, chunk;
+	ssize_t res;
+
+	/* Messages larger than buf are received and verified in chunks */
+	while (len) {
+		chunk = min(len, (unsigned int)sizeof(buf));
+		for (avail = 0; avail < chunk; avail += res) {
+			if (receive_wait(fd))
+				return -1;
+			res = read(fd, buf + avail, chunk - avail);
+			if (res < 0) {
+				pr_error("Read error %d\n", errno);
+				exit(-1);
+			}
+			rx_account(res);
+			frame_feed(buf + avail, res);
+		}
+
+		if (verify_data(msg, buf, offset, chunk))
+			return -1;
+		offset += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+static void *verify_start(void *arg)
+{
+	struct msg *msg = arg;
+	struct timespec idle = { .tv_nsec = VERIFY_POLL_US * 1000 };
+	unsigned long long head, tail = 0;
+	struct cpu_sample cs;
+	unsigned int pos, n;
+
+	cpu_begin(&cs);
+	verify_failed = 0;
+	while (tail < msg->rxlen && !verify_abort) {
+		head = atomic_load_explicit(&verify_head, memory_order_acquire);
+		if (head == tail) {
+			nanosleep(&idle, NULL);
+			continue;
+		}
+
+		pos = tail % VERIFY_RING_SIZE;
+		n = min(head - tail, (unsigned long long)VERIFY_RING_SIZE - pos);
+		frame_feed(verify_ring + pos, n);
+		/* Keep on consuming after a failure, to drain the ring */
+		if (!verify_failed &&
+		    verify_data(msg, verify_ring + pos, tail, n))
+			verify_failed = 1;
+
+		tail += n;
+		atomic_store_explicit(&verify_tail, tail, memory_order_release);
+	}
+
+	msg->cpu[CPU_VFY] = cpu_end(&cs, CPU_VFY);
+
+	return NULL;
+}
+
+/*
+ * Receive the bytes to consume into the verify ring, leaving verification to
+ * the verifier thread, so a slow comparison or dump can never stall the port
+ */
+static int receive_decoupled(int fd, struct msg *msg)
+{
+	unsigned long long head = 0, tail, depth;
+	unsigned int pos, n;
+	ssize_t res;
+	int failed = 0;
+
+	atomic_store(&verify_head, 0);
+	atomic_store(&verify_tail, 0);
+	verify_abort = 0;
+	pthread_create(&verify_thread, NULL, verify_start, msg);
+
+	while (head < msg->rxlen) {
+		tail = atomic_load_explicit(&verify_tail, memory_order_acquire);
+		depth = head - tail;
+		if (depth == VERIFY_RING_SIZE) {
+			verify_stalls++;
+			sched_yield();
+			continue;
+		}
+
+		if (receive_wait(fd)) {
+			failed = 1;
+			break;
+		}
+
+		pos = head % VERIFY_RING_SIZE;
+		n = min(msg->rxlen - head, VERIFY_RING_SIZE - depth);
+		n = min(n, VERIFY_RING_SIZE - pos);
+		res = read(fd, verify_ring + pos, n);
+		if (res < 0) {
+			pr_error("Read error %d\n", errno);
+			exit(-1);
+		}
+		rx_account(res);
+		head += res;
+		atomic_store_explicit(&verify_head, head, memory_order_release);
+		verify_max_depth = max(verify_max_depth, depth + res);
+	}
+
+	verify_abort = failed;
+	pthread_join(verify_thread, NULL);
+
+	/* Bytes left behind on abort still reach the frame decoder */
+	for (tail = atomic_load(&verify_tail); tail < head; tail += n) {
+		pos = tail % VERIFY_RING_SIZE;
+		n = min(head - tail, (unsigned long long)VERIFY_RING_SIZE - pos);
+		frame_feed(verify_ring + pos, n);
+	}
+
+	return failed || verify_failed ? -1 : 0;
+}
+
+/*
+ * In raw mode (no IGNBRK, BRKINT, or PARMRK), a break is read as a single NUL
+ * byte.  Check that, and the break counter, if the driver provides one.
+ */
+static int receive_break(int fd, const struct msg *msg,
+			 const struct serial_icounter_struct *icount)
+{
+	struct serial_icounter_struct icount2;
+	unsigned char c;
+	ssize_t res;
+
+	do {
+		if (receive_wait(fd))
+			return -1;
+		res = read(fd, &c, 1);
+	} while (!res);
+	if (res < 0) {
+		pr_error("Read error %d\n", errno);
+		exit(-1);
+	}
+	rx_account(1);
+
+	if (c) {
+		pr_error("Break not seen at offset %d, got 0x%02x\n",
+			 msg->brk, c);
+		return receive_failed();
+	}
+
+	if (icount && !ioctl(fd, TIOCGICOUNT, &icount2)) {
+		if (icount2.brk == icount->brk) {
+			pr_error("Break at offset %d not counted\n", msg->brk);
+			return receive_failed();
+		}
+		breaks_counted += icount2.brk - icount->brk;
+	}
+	return 0;
+}
+
+/*
+ * Nothing has been sent yet, so anything arriving within the grace window
+ * survived the flush.  It is discarded, and accounted to the length of the
+ * previous message, whose unconsumed remainder it should have been part of.
+ */
+static void flush_probe(int fd, uint64_t flush_ns)
+{
+	unsigned char buf[TTY_BUF_SIZE];
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	uint64_t end = now_ns() + opt_flush_probe * 1000ULL, t;
+	unsigned int leaked = 0, b;
+	struct timespec ts;
+	ssize_t res;
+
+	while ((t = now_ns()) < end) {
+		ns_to_timespec(end - t, &ts);
+		if (ppoll(&pfd, 1, &ts, NULL) <= 0)
+			break;
+		res = read(fd, buf, sizeof(buf));
+		if (res <= 0)
+			break;
+		leaked += res;
+	}
+
+	hist_add(&flush_hist, flush_ns);
+	flush_msgs++;
+	if (leaked) {
+		pr_debug("%u bytes leaked through the flush\n", leaked);
+		flush_leaks++;
+		flush_leaked += leaked;
+		flush_leak_max = max(flush_leak_max, leaked);
+	}
+
+	if (!prev_len)
+		return;
+
+	b = len_bucket(prev_len);
+	flush_unconsumed += prev_len - prev_rxlen;
+	flush_len_msgs[b]++;
+	if (leaked) {
+		flush_len_leaks[b]++;
+		flush_len_leaked[b] += leaked;
+	}
+}
+
+static void *receive_start(void *arg)
+{
+	struct serial_icounter_struct icount;
+	struct receiver *rx = arg;
+	struct msg *msg = rx->msg;
+	struct cpu_sample cs;
+	int have_icount, res;
+	uint64_t t, flush_ns;
+	int fd;
+
+	rx_self = rx;
+	cpu_begin(&cs);
+	t = now_ns();
+	fd = device_open_flush(rx->pathname, O_RDONLY, 1, &flush_ns);
+	rx->rx_open = now_ns() - t;
+	rx->rx_end = 0;
+	if (opt_flush_probe)
+		flush_probe(fd, flush_ns);
+	if (opt_framing)
+		frame_dec_start(msg);
+
+	/* Our input queue has been flushed, transmission may start */
+	sem_post(&rx_ready);
+
+	/* Queue levels are only sampled on rxdev */
+	if (rx == receivers)
+		rx_fd = fd;
+
+	if (msg->brk >= 0) {
+		/* Data on both sides of the break must survive */
+		have_icount = !ioctl(fd, TIOCGICOUNT, &icount);
+		pr_debug(ESC_GREEN "Receiving message of size %u with break at offset %d\n",
+			 msg->len, msg->brk);
+		res = receive_data(fd, msg, 0, msg->brk) ||
+		      receive_break(fd, msg, have_icount ? &icount : NULL) ||
+		      receive_data(fd, msg, msg->brk, msg->len - msg->brk);
+	} else {
+		pr_debug(ESC_GREEN "Receiving first %u bytes of message of size %u\n",
+			 msg->rxlen, msg->len);
+
+		if (opt_verify_thread)
+			res = receive_decoupled(fd, msg);
+		else
+			res = receive_data(fd, msg, 0, msg->rxlen);
+	}
+
+	if (opt_framing)
+		frame_dec_end();
+
+	rx->msgs++;
+	if (res) {
+		rx->failures++;
+	} else {
+		rx->rx_end = now_ns();
+		pr_debug(ESC_GREEN "OK\n");
+	}
+
+	if (rx == receivers)
+		rx_fd = -1;
+	close(fd);
+	rx->cpu = cpu_end(&cs, CPU_RX);
+
+	return NULL;
+}
+
+static void load_work(const struct load *load, uint64_t until,
+		      unsigned char *mem)
+{
+	static volatile unsigned long sink;
+	unsigned long x = (unsigned long)mem | 1;
+	unsigned int i, pos = 0;
+
+	while (now_ns() < until) {
+		switch (load->type) {
+		case LOAD_CPU:
+			for (i = 0; i < 1000; i++)
+				sink++;
+			break;
+
+		case LOAD_MEM:
+			/* Stream one half of the buffer into the other */
+			memcpy(mem + LOAD_MEM_SIZE / 2 + pos, mem + pos,
+			       LOAD_MEM_CHUNK);
+			pos = (pos + LOAD_MEM_CHUNK) % (LOAD_MEM_SIZE / 2);
+			break;
+
+		case LOAD_CACHE:
+			/* Random cache line accesses, defeating prefetching */
+			for (i = 0; i < 1000; i++) {
+				x ^= x << 13;
+				x ^= x >> 7;
+				x ^= x << 17;
+				mem[(x * 64) % LOAD_CACHE_SIZE]++;
+			}
+			break;
+
+		case LOAD_SYSCALL:
+			for (i = 0; i < 100; i++)
+				sink += getppid();
+			break;
+		}
+	}
+}
+
+static void *load_start(void *arg)
+{
+	const struct load *load = arg;
+	struct timespec ts, idle = { .tv_nsec = LOAD_PERIOD_US * 1000 };
+	uint64_t period = LOAD_PERIOD_US * 1000ULL, next = now_ns();
+	unsigned char *mem = NULL;
+	cpu_set_t cpus;
+
+	if (load->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(load->cpu, &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+
+	if (load->type == LOAD_MEM)
+		mem = calloc(1, LOAD_MEM_SIZE);
+	else if (load->type == LOAD_CACHE)
+		mem = calloc(1, LOAD_CACHE_SIZE);
+
+	while (1) {
+		if (!load_active) {
+			nanosleep(&idle, NULL);
+			next = now_ns();
+			continue;
+		}
+
+		load_work(load, next + period * load->duty / 100, mem);
+		next += period;
+		if (load->duty < 100) {
+			ns_to_timespec(next, &ts);
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+					NULL);
+		}
+	}
+
+	return NULL;
+}
+
+static void load_init(void)
+{
+	unsigned int i, j;
+	pthread_t thread;
+
+	for (i = 0; i < nloads; i++)
+		for (j = 0; j < loads[i].threads; j++)
+			pthread_create(&thread, NULL, load_start, &loads[i]);
+}
+
+/*
+ * Alternate between idle and loaded phases, and account each message to the
+ * phase it ran in
+ */
+static void load_phase_start(void)
+{
+	if (nloads)
+		load_active = (msgs / opt_load_phase) % 2;
+}
+
+static void load_phase_end(const struct msg *msg, unsigned int failures)
+{
+	struct phase_stats *ps = &phase_stats[load_active];
+
+	if (!nloads)
+		return;
+
+	ps->msgs++;
+	ps->failures += rx_failures - failures;
+	if (msg->rx_end)
+		hist_add(&ps->lat, msg->rx_end - msg->tx_start);
+}
+
+static struct msg *msg_next(void)
+{
+	if (opt_payload)
+		return msg_payload();
+	if (nauto_lens)
+		return msg_gen(auto_lens[brahe_prng_range(&prng, 0,
+							  nauto_lens - 1)]);
+	return msg_gen(-opt_msglen);
+}
+
+static void *gen_start(void *arg)
+{
+	struct cpu_sample cs;
+	struct msg *msg;
+	unsigned int i;
+
+	for (i = 0; !opt_nmsgs || i < opt_nmsgs; i++) {
+		sem_wait(&msg_ring_space);
+		cpu_begin(&cs);
+		msg = msg_next();
+		msg->cpu[CPU_GEN] = cpu_end(&cs, CPU_GEN);
+		msg_ring[msg_ring_head] = msg;
+		msg_ring_head = (msg_ring_head + 1) % MAX_LIST_SIZE;
+		sem_post(&msg_ring_filled);
+	}
+
+	return NULL;
+}
+
+static struct msg *msg_dequeue(void)
+{
+	struct msg *msg;
+
+	sem_wait(&msg_ring_filled);
+	msg = msg_ring[msg_ring_tail];
+	msg_ring_tail = (msg_ring_tail + 1) % MAX_LIST_SIZE;
+	sem_post(&msg_ring_space);
+
+	return msg;
+}
+
+static int irq_is_number(const char *s)
+{
+	return *s && s[strspn(s, "0123456789")] == '\0';
+}
+
+/*
+ * Match the device names at the end of a /proc/interrupts line.  They follow
+ * the chip, the hwirq (absent without a domain, or with the flow name
+ * appended), and the trigger, none of which may match.
+ */
+static int irq_match_name(char *p, const char *match)
+{
+	char *tok;
+
+	tok = strtok(p, " \n");
+	tok = strtok(NULL, " ,\n");
+	if (tok && *tok >= '0' && *tok <= '9')
+		tok = strtok(NULL, " ,\n");
+	while (tok && (*tok == '-' || !strcmp(tok, "Level") ||
+		       !strcmp(tok, "Edge")))
+		tok = strtok(NULL, " ,\n");
+
+	for (; tok; tok = strtok(NULL, " ,\n"))
+		if (!strcmp(tok, match))
+			return 1;
+	return 0;
+}
+
+/*
+ * Read the per-CPU counts of the /proc/interrupts line whose label (the IRQ
+ * number) or one of whose device names matches.  Returns zero on success.
+ */
+static int irq_read(const char *match, unsigned long long *counts,
+		    char *label_buf, size_t label_len)
+{
+	char *line = NULL, *label, *p;
+	unsigned int i, ncpus = 0;
+	size_t size = 0;
+	int found = 0, by_name = !irq_is_number(match);
+	FILE *f;
+
+	f = fopen("/proc/interrupts", "r");
+	if (!f)
+		return -1;
+
+	/* The header names the online CPUs, one column each */
+	if (getline(&line, &size, f) > 0)
+		for (p = line; (p = strstr(p, "CPU")); p++)
+			ncpus++;
+	if (ncpus > MAX_IRQ_CPUS)
+		ncpus = MAX_IRQ_CPUS;
+
+	while (!found && getline(&line, &size, f) > 0) {
+		label = line + strspn(line, " ");
+		p = strchr(label, ':');
+		if (!p)
+			continue;
+		*p++ = '\0';
+		for (i = 0; i < ncpus; i++)
+			counts[i] = strtoull(p, &p, 10);
+
+		/* Numbers only match the label, names only the device names */
+		found = !strcmp(label, match);
+		if (!found && by_name && irq_is_number(label))
+			found = irq_match_name(p, match);
+		if (found && label_buf)
+			snprintf(label_buf, label_len, "%s", label);
+	}
+	free(line);
+	fclose(f);
+
+	irq_ncpus = ncpus;
+	return found ? 0 : -1;
+}
+
+static void irq_init(void)
+{
+	const char *match = opt_irq;
+	char num[16];
+
+	if (!strcmp(opt_irq, "auto")) {
+		if (!rx_port.valid || rx_port.ss.irq <= 0) {
+			pr_error("Cannot determine the IRQ of %s, please specify it\n",
+				 opt_rxdev);
+			exit(-1);
+		}
+		snprintf(num, sizeof(num), "%d", rx_port.ss.irq);
+		match = num;
+	}
+
+	if (irq_read(match, irq_start, irq_label, sizeof(irq_label))) {
+		pr_error("IRQ %s not found in /proc/interrupts\n", match);
+		exit(-1);
+	}
+	pr_info("Accounting interrupts of IRQ %s\n", irq_label);
+}
+
+static void irq_msg_end(void)
+{
+	unsigned long long counts[MAX_IRQ_CPUS], n = 0;
+	unsigned int i;
+
+	if (irq_read(irq_label, counts, NULL, 0))
+		return;
+
+	for (i = 0; i < irq_ncpus; i++) {
+		irq_cpu[i] += counts[i] - irq_start[i];
+		n += counts[i] - irq_start[i];
+	}
+	pr_debug("IRQ %s: %llu interrupts\n", irq_label, n);
+
+	irq_total += n;
+	irq_msg_min = min(irq_msg_min, n);
+	irq_msg_max = max(irq_msg_max, n);
+	irq_msgs++;
+}
+
+/*
+ * Fold the results of all receivers into the message, which only arrived
+ * once it arrived everywhere
+ */
+static void receivers_collect(struct msg *msg)
+{
+	uint64_t first = UINT64_MAX, last = 0;
+	unsigned int i, ok = 0;
+
+	for (i = 0; i < nreceivers; i++) {
+		struct receiver *rx = &receivers[i];
+
+		msg->stage[STAGE_RX_OPEN] = max(msg->stage[STAGE_RX_OPEN],
+						rx->rx_open);
+		msg->cpu[CPU_RX] += rx->cpu;
+		if (!rx->rx_end)
+			continue;
+
+		hist_add(&rx->lat, rx->rx_end - msg->tx_start);
+		first = min(first, rx->rx_end);
+		last = max(last, rx->rx_end);
+		ok++;
+	}
+
+	msg->rx_end = ok == nreceivers ? last : 0;
+	if (ok > 1)
+		hist_add(&rx_skew_hist, last - first);
+
+	len_msgs[len_bucket(msg->len)]++;
+	if (!msg->rx_end) {
+		len_errors[len_bucket(msg->len)]++;
+		rx_failures++;
+	}
+}
+
+static void run_msg(struct msg *msg)
+{
+	struct timespec ts;
+	unsigned int i;
+	uint32_t gap;
+
+	if (opt_qsample) {
+		qsampling = 1;
+		pthread_create(&qsample_thread, NULL, qsample_start, NULL);
+	}
+
+	if (opt_irq)
+		irq_read(irq_label, irq_start, NULL, 0);
+
+	rx_collecting = 1;
+	for (i = 0; i < nreceivers; i++) {
+		receivers[i].msg = msg;
+		pthread_create(&receivers[i].thread, NULL, receive_start,
+			       &receivers[i]);
+	}
+
+	/* The receivers must be ready, else their flush may eat our data */
+	for (i = 0; i < nreceivers; i++)
+		sem_wait(&rx_ready);
+
+	/* The idle gap starts at the end of the previous message */
+	gap = opt_gap_min;
+	if (opt_gap_max > opt_gap_min)
+		gap = brahe_prng_range(&gap_prng, opt_gap_min, opt_gap_max);
+	if (gap) {
+		ns_to_timespec(last_msg_end + gap * 1000ULL, &ts);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+
+	/* Pace against an absolute schedule, so errors don't accumulate */
+	if (opt_rate) {
+		if (!rate_next)
+			rate_next = now_ns();
+		ns_to_timespec(rate_next, &ts);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		if (opt_rate_bytes)
+			rate_next += msg->len * 1000000000ULL / opt_rate;
+		else
+			rate_next += 1000000000ULL / opt_rate;
+	}
+
+	pthread_create(&tx_thread, NULL, transmit_start, msg);
+
+	for (i = 0; i < nreceivers; i++)
+		pthread_join(receivers[i].thread, NULL);
+	pthread_join(tx_thread, NULL);
+	last_msg_end = now_ns();
+	receivers_collect(msg);
+	rx_collecting = 0;
+	prev_len = msg->len;
+	prev_rxlen = msg->rxlen;
+
+	if (opt_irq)
+		irq_msg_end();
+
+	if (msg->rx_end)
+		hist_add(&msg_lat_hist, msg->rx_end - msg->tx_start);
+	for (i = 0; i < MSG_STAGES; i++)
+		hist_add(&stage_hist[i], msg->stage[i]);
+
+	if (opt_qsample) {
+		qsampling = 0;
+		pthread_join(qsample_thread, NULL);
+		qsample_flush();
+	}
+}
+
+/*
+ * Run a window of messages of the given length (negative for random lengths
+ * up to -len), stopping at the first failure
+ */
+static int search_trial(int len)
+{
+	unsigned int i, failures = rx_failures;
+	struct msg *msg;
+
+	for (i = 0; i < opt_search_window; i++, msgs++) {
+		msg = msg_gen(len);
+		run_msg(msg);
+		free(msg);
+		if (rx_failures != failures)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Find the highest speed, then the largest message length at that speed, and
+ * finally the smallest gap between messages, that all run error-free
+ */
+static void search_envelope(void)
+{
+	unsigned int i, lo, hi, mid, best_speed = 0;
+	int pass;
+
+	if (!opt_speed)
+		opt_speed = SEARCH_MIN_SPEED;
+
+	for (i = 0; i < sizeof(speeds)/sizeof(*speeds); i++) {
+		if (speeds[i].val < opt_speed)
+			continue;
+		opt_speed = speeds[i].val;
+		pass = search_trial(-opt_msglen);
+		pr_info("Speed %u: %s\n", opt_speed, pass ? "pass" : "FAIL");
+		if (!pass)
+			break;
+		best_speed = opt_speed;
+	}
+	if (!best_speed) {
+		pr_error("No error-free speed found\n");
+		return;
+	}
+	opt_speed = best_speed;
+
+	/* Largest passing length is in [lo, hi) */
+	lo = 0;
+	hi = MAX_MAX_MSG_LEN + 1;
+	for (mid = MAX_MAX_MSG_LEN; hi - lo > 1; mid = lo + (hi - lo) / 2) {
+		pass = search_trial(mid);
+		pr_info("Length %u: %s\n", mid, pass ? "pass" : "FAIL");
+		if (pass)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	if (!lo) {
+		pr_error("No error-free message length found\n");
+		return;
+	}
+	opt_msglen = lo;
+
+	/* Smallest passing gap is in (lo, hi] */
+	lo = 0;
+	hi = SEARCH_MAX_GAP;
+	opt_gap_min = opt_gap_max = 0;
+	pass = search_trial(-opt_msglen);
+	pr_info("Gap 0 µs: %s\n", pass ? "pass" : "FAIL");
+	if (pass) {
+		hi = 0;
+	} else {
+		opt_gap_min = opt_gap_max = hi;
+		pass = search_trial(-opt_msglen);
+		pr_info("Gap %u µs: %s\n", hi, pass ? "pass" : "FAIL");
+		if (!pass) {
+			pr_error("No error-free gap found\n");
+			return;
+		}
+	}
+	while (hi - lo > SEARCH_GAP_RESOLUTION) {
+		opt_gap_min = opt_gap_max = lo + (hi - lo) / 2;
+		pass = search_trial(-opt_msglen);
+		pr_info("Gap %u µs: %s\n", opt_gap_min, pass ? "pass" : "FAIL");
+		if (pass)
+			hi = opt_gap_min;
+		else
+			lo = opt_gap_min;
+	}
+	opt_gap_min = opt_gap_max = hi;
+
+	pr_warn("Error-free envelope (window %u messages): speed %u, length %u, gap %u µs\n",
+		opt_search_window, opt_speed, opt_msglen, hi);
+}
+
+/*
+ * Both sides generate the same frame sequence from their own PRNG, so the
+ * transmitter never has to wait for anything but its schedule
+ */
+static void frame_fill(brahe_prng_state_t *state, struct msg *frame)
+{
+	unsigned int i;
+
+	for (i = 0; i < frame->len; i++)
+		frame->buf[i] = brahe_prng_next(state);
+}
+
+static struct msg *frame_alloc(void)
+{
+	struct msg *frame;
+
+	frame = malloc(sizeof(*frame) + opt_msglen);
+	memset(frame, 0, sizeof(*frame));
+	frame->len = frame->rxlen = opt_msglen;
+	frame->data = frame->buf;
+	frame->brk = -1;
+
+	return frame;
+}
+
+static void *period_tx_start(void *arg)
+{
+	int fd = device_open(opt_txdev, O_WRONLY, 1);
+	struct msg *frame = frame_alloc();
+	brahe_prng_state_t state;
+	uint64_t slot, start;
+	struct timespec ts;
+
+	brahe_prng_init(&state, BRAHE_PRNG_MARSENNE_TWISTER, opt_seed);
+
+	for (msgs = 0; !run_done(); msgs++) {
+		frame_fill(&state, frame);
+
+		slot = period_start + (uint64_t)msgs * opt_period * 1000;
+		ns_to_timespec(slot, &ts);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		start = now_ns();
+
+		hist_add(&period_tx_hist, start - slot);
+		if (start - slot >= opt_period * 1000ULL)
+			period_overruns++;
+
+		transmit_data(fd, frame, 0, frame->len);
+	}
+	period_frames = msgs;
+
+	free(frame);
+	close(fd);
+
+	return NULL;
+}
+
+/*
+ * Wait until data is available, or the transmitter has finished and all its
+ * frames have been received
+ */
+static int period_rx_wait(int fd, unsigned int n)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	uint64_t deadline = 0;
+
+	while (n < period_frames) {
+		if (poll(&pfd, 1, 10) > 0)
+			return 0;
+		if (period_frames == UINT_MAX)
+			continue;
+		/* Transmitter done, give the missing frames some time */
+		if (!deadline)
+			deadline = now_ns() + RX_TIMEOUT * 1000000000ULL;
+		if (now_ns() > deadline) {
+			pr_error("Lost %u frames\n", period_frames - n);
+			receive_failed();
+			return 1;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Discard the rest of a failed frame, and whatever followed it, up to the
+ * next gap of half a period between frames.  Returns nonzero if the line never
+ * went quiet, so frames cannot be told apart anymore.
+ */
+static int period_rx_drain(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	uint64_t deadline = now_ns() + RX_TIMEOUT * 1000000000ULL;
+	struct timespec quiet;
+
+	ns_to_timespec(opt_period * 500ULL, &quiet);
+	while (ppoll(&pfd, 1, &quiet, NULL) > 0) {
+		tcflush(fd, TCIFLUSH);
+		if (now_ns() > deadline) {
+			pr_error("No gap between frames, cannot resynchronize\n");
+			return -1;
+		}
+	}
+	tcflush(fd, TCIFLUSH);
+	return 0;
+}
+
+static void *period_rx_start(void *arg)
+{
+	int fd = device_open(opt_rxdev, O_RDONLY, 1);
+	struct msg *frame = frame_alloc();
+	brahe_prng_state_t state;
+	unsigned int n, k;
+	int resync = 0;
+	uint64_t slot;
+
+	brahe_prng_init(&state, BRAHE_PRNG_MARSENNE_TWISTER, opt_seed);
+	sem_post(&rx_ready);
+
+	for (n = 0; !period_rx_wait(fd, n); n++) {
+		if (resync) {
+			/* The frame now arriving belongs to the current slot */
+			k = (now_ns() - period_start) / (opt_period * 1000ULL);
+			if (k > n)
+				pr_error("Resynchronized, skipped %u frames\n",
+					 k - n);
+			for (; n < k; n++) {
+				frame_fill(&state, frame);
+				receive_failed();
+			}
+			resync = 0;
+		}
+
+		frame_fill(&state, frame);
+		if (receive_data(fd, frame, 0, frame->len)) {
+			/* A lost byte would shift all later frames */
+			if (period_rx_drain(fd))
+				break;
+			resync = 1;
+			continue;
+		}
+
+		slot = period_start + (uint64_t)n * opt_period * 1000;
+		hist_add(&period_rx_hist, now_ns() - slot);
+	}
+
+	free(frame);
+	close(fd);
+
+	return NULL;
+}
+
+/*
+ * Transmit a fixed-size frame every period, and measure how far transmission
+ * start and reception completion deviate from the ideal schedule
+ */
+static void period_bench(void)
+{
+	pthread_create(&rx_thread, NULL, period_rx_start, NULL);
+	sem_wait(&rx_ready);
+
+	period_start = now_ns() + opt_period * 1000ULL;
+	pthread_create(&tx_thread, NULL, period_tx_start, NULL);
+
+	pthread_join(tx_thread, NULL);
+	pthread_join(rx_thread, NULL);
+}
+
+struct burst_stats {
+	unsigned int count, max_chunk;
+	uint64_t first, complete;	/* sums of latencies */
+};
+
+/*
+ * Send a burst, and time until the first read returns, and until the burst
+ * has been received completely.  Returns the size of the first chunk.
+ */
+static unsigned int burst_run(int txfd, int rxfd, unsigned int len,
+			      struct burst_stats *bs)
+{
+	static unsigned char buf[MAX_MAX_MSG_LEN];
+	struct msg *msg = msg_gen(len);
+	unsigned int avail = 0, first = 0;
+	uint64_t start, t = 0, first_t = 0;
+	ssize_t res;
+
+	start = now_ns();
+	transmit_data(txfd, msg, 0, len);
+
+	while (avail < len) {
+		if (receive_wait(rxfd))
+			goto fail;
+		res = read(rxfd, buf + avail, len - avail);
+		if (res < 0) {
+			pr_error("Read error %d\n", errno);
+			exit(-1);
+		}
+		t = now_ns();
+		if (!avail) {
+			first = res;
+			first_t = t;
+		}
+		avail += res;
+		rx_bytes += res;
+	}
+
+	if (verify_data(msg, buf, 0, len))
+		goto fail;
+
+	/* Only complete bursts count, so all averages share one base */
+	bs->first += first_t - start;
+	bs->complete += t - start;
+	bs->max_chunk = max(bs->max_chunk, first);
+	bs->count++;
+	free(msg);
+	return first;
+
+fail:
+	/* Don't let the rest of this burst shift the following ones */
+	receive_drain(rxfd);
+	free(msg);
+	return first;
+}
+
+/*
+ * Send bursts of 1..n bytes, to find the effective FIFO depth (the largest
+ * first chunk) and the RX trigger level (where the character timeout path
+ * stops determining the first-byte latency)
+ */
+static void characterize(void)
+{
+	int txfd = device_open(opt_txdev, O_WRONLY, 1);
+	int rxfd = device_open(opt_rxdev, O_RDONLY, 1);
+	unsigned int len, i, repeat = opt_nmsgs ? opt_nmsgs : CHAR_REPEAT;
+	unsigned int depth = 0, step_len = 0;
+	double lat, prev_lat = 0, step = 0;
+	struct burst_stats *bs;
+
+	bs = calloc(opt_characterize + 1, sizeof(*bs));
+
+	pr_info("  len  max 1st chunk  1st byte µs  complete µs\n");
+	for (len = 1; len <= opt_characterize; len++) {
+		for (i = 0; i < repeat; i++, msgs++)
+			burst_run(txfd, rxfd, len, &bs[len]);
+		if (!bs[len].count)
+			continue;
+
+		lat = bs[len].first / 1e3 / bs[len].count;
+		pr_info("%5u %14u %12.1f %12.1f\n", len, bs[len].max_chunk,
+			lat, bs[len].complete / 1e3 / bs[len].count);
+
+		depth = max(depth, bs[len].max_chunk);
+		if (len > 1 && prev_lat - lat > step) {
+			step = prev_lat - lat;
+			step_len = len;
+		}
+		prev_lat = lat;
+	}
+
+	pr_warn("Effective FIFO depth (largest first chunk): %u bytes\n",
+		depth);
+	if (step_len)
+		pr_warn("Largest first-byte latency drop: %.1f µs at %u bytes (likely RX trigger level)\n",
+			step, step_len);
+
+	free(bs);
+	close(rxfd);
+	close(txfd);
+}
+
+/*
+ * Churn device_open() and close() on both devices, profiling each step
+ */
+static void open_bench(void)
+{
+	uint64_t t;
+	int fd;
+
+	for (msgs = 0; !run_done(); msgs++) {
+		open_prof = tx_open_prof;
+		fd = device_open(opt_txdev, O_WRONLY, 1);
+		t = now_ns();
+		close(fd);
+		open_step(OPEN_CLOSE, &t);
+
+		open_prof = rx_open_prof;
+		fd = device_open(opt_rxdev, O_RDONLY, 1);
+		t = now_ns();
+		close(fd);
+		open_step(OPEN_CLOSE, &t);
+	}
+	open_prof = NULL;
+}
+
+/*
+ * USB serial adapters (e.g. FTDI) hold back received data for up to
+ * latency_timer ms, which dominates the latency of small messages
+ */
+static int latency_timer_find(const char *pathname, char *attr, size_t len)
+{
+	char real[PATH_MAX];
+	const char *name;
+
+	if (!realpath(pathname, real))
+		return 0;
+	name = strrchr(real, '/');
+	name = name ? name + 1 : real;
+
+	if (snprintf(attr, len, "/sys/class/tty/%s/device/latency_timer",
+		     name) >= len || access(attr, R_OK)) {
+		attr[0] = '\0';
+		return 0;
+	}
+	return 1;
+}
+
+static int latency_timer_get(const char *attr)
+{
+	FILE *f = fopen(attr, "r");
+	int val = -1;
+
+	if (!f || fscanf(f, "%d", &val) != 1)
+		pr_error("Failed to read %s: %s\n", attr, strerror(errno));
+	if (f)
+		fclose(f);
+	return val;
+}
+
+static int latency_timer_write(const char *attr, unsigned int val)
+{
+	FILE *f = fopen(attr, "w");
+
+	if (!f || fprintf(f, "%u\n", val) < 0 || fclose(f)) {
+		pr_error("Failed to set %s: %s\n", attr, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void latency_timer_set(const char *attr, unsigned int val)
+{
+	if (latency_timer_write(attr, val))
+		exit(-1);
+}
+
+static void latency_timer_restore(void)
+{
+	/* Runs at exit, so failures are only reported */
+	if (tx_latency_saved >= 0)
+		latency_timer_write(tx_latency_path, tx_latency_saved);
+	if (rx_latency_saved >= 0)
+		latency_timer_write(rx_latency_path, rx_latency_saved);
+}
+
+static void latency_timer_init(void)
+{
+	if (latency_timer_find(opt_txdev, tx_latency_path,
+			       sizeof(tx_latency_path))) {
+		tx_latency_saved = latency_timer_get(tx_latency_path);
+		pr_info("%s is a USB serial device, latency_timer %d ms\n",
+			opt_txdev, tx_latency_saved);
+	}
+	if (latency_timer_find(opt_rxdev, rx_latency_path,
+			       sizeof(rx_latency_path))) {
+		rx_latency_saved = latency_timer_get(rx_latency_path);
+		pr_info("%s is a USB serial device, latency_timer %d ms\n",
+			opt_rxdev, rx_latency_saved);
+	}
+	if (!tx_latency_path[0] && !rx_latency_path[0]) {
+		if (opt_latency_timer >= 0 || opt_latency_sweep) {
+			pr_error("No USB serial device with a latency_timer\n");
+			exit(-1);
+		}
+		return;
+	}
+
+	atexit(latency_timer_restore);
+}
+
+static void latency_timer_apply(unsigned int val)
+{
+	if (tx_latency_path[0])
+		latency_timer_set(tx_latency_path, val);
+	if (rx_latency_path[0])
+		latency_timer_set(rx_latency_path, val);
+}
+
+/*
+ * Run a window of messages at each latency_timer setting, and report the
+ * latency/throughput trade-off
+ */
+static void latency_timer_sweep(void)
+{
+	unsigned int i, j, window = opt_nmsgs ? opt_nmsgs : SWEEP_WINDOW;
+	unsigned long long bytes;
+	uint64_t start;
+	struct msg *msg;
+
+	pr_info("latency_timer   msgs   p50 lat µs   p99 lat µs   bytes/s\n");
+	for (i = 0; i < sizeof(latency_sweep)/sizeof(*latency_sweep); i++) {
+		latency_timer_apply(latency_sweep[i]);
+		memset(&msg_lat_hist, 0, sizeof(msg_lat_hist));
+		bytes = rx_bytes;
+		start = now_ns();
+
+		for (j = 0; j < window; j++, msgs++) {
+			msg = msg_gen(-opt_msglen);
+			run_msg(msg);
+			free(msg);
+		}
+
+		pr_info("%10u ms %6llu %12.1f %12.1f %9.0f\n",
+			latency_sweep[i], msg_lat_hist.count,
+			hist_percentile(&msg_lat_hist, 50) / 1e3,
+			hist_percentile(&msg_lat_hist, 99) / 1e3,
+			(rx_bytes - bytes) * 1e9 / (now_ns() - start));
+	}
+}
+
+static void auto_len_add(unsigned int len)
+{
+	unsigned int i;
+
+	if (!len || nauto_lens == MAX_AUTO_LENS)
+		return;
+	for (i = 0; i < nauto_lens; i++)
+		if (auto_lens[i] == len)
+			return;
+	auto_lens[nauto_lens++] = len;
+}
+
+/*
+ * Derive defaults from the reported FIFO size, so runs focus on the boundaries
+ * that matter: lengths around the FIFO depth and its multiples, and around the
+ * tty buffer size, and error offsets modulo the FIFO depth
+ */
+static void port_defaults(void)
+{
+	const struct port *port = rx_port.valid ? &rx_port : &tx_port;
+	unsigned int fifo, len;
+
+	close(device_open(opt_txdev, O_WRONLY, 0));
+	close(device_open(opt_rxdev, O_RDONLY, 0));
+
+	if (!port->valid || port->ss.xmit_fifo_size <= 1)
+		return;
+	fifo = port->ss.xmit_fifo_size;
+
+	if (!opt_nerr_mods)
+		opt_err_mods[opt_nerr_mods++] = fifo;
+
+	if (opt_msglen_set || opt_payload)
+		return;
+
+	auto_len_add(fifo - 1);
+	auto_len_add(fifo);
+	auto_len_add(fifo + 1);
+	for (len = 2 * fifo; len < TTY_BUF_SIZE; len *= 2)
+		auto_len_add(len);
+	auto_len_add(TTY_BUF_SIZE - 1);
+	auto_len_add(TTY_BUF_SIZE);
+	auto_len_add(TTY_BUF_SIZE + 1);
+
+	pr_info("Using %u message lengths derived from FIFO size %u\n",
+		nauto_lens, fifo);
+}
+
+/*
+ * Echo responder: mirror everything received on rxdev to txdev, as soon as it
+ * arrives
+ */
+static void __attribute__ ((noreturn)) echo_respond(void)
+{
+	int rxfd = device_open(opt_rxdev, O_RDONLY, 1);
+	int txfd = device_open(opt_txdev, O_WRONLY, 1);
+	unsigned char buf[MAX_MAX_MSG_LEN];
+	ssize_t res, done, n;
+
+	pr_info("Echoing %s to %s\n", opt_rxdev, opt_txdev);
+	while (1) {
+		res = read(rxfd, buf, sizeof(buf));
+		if (res < 0) {
+			pr_error("Read error %d\n", errno);
+			exit(-1);
+		}
+		rx_bytes += res;
+
+		for (done = 0; done < res; done += n) {
+			n = write(txfd, buf + done, res - done);
+			if (n < 0) {
+				pr_error("Write error %d\n", errno);
+				exit(-1);
+			}
+			tx_bytes += n;
+		}
+	}
+}
 
-	pr_debug(ESC_GREEN "OK\n");
+/*
+ * Requester: send each message, and time until its echo has been received
+ * and verified completely
+ */
+static void pingpong(void)
+{
+	int txfd = device_open(opt_txdev, O_WRONLY, 1);
+	int rxfd = device_open(opt_rxdev, O_RDONLY, 1);
+	struct msg *msg;
+	uint64_t start, rtt;
 
-	close(fd);
+	for (msgs = 0; !run_done(); msgs++) {
+		msg = msg_gen(-opt_msglen);
+
+		start = now_ns();
+		transmit_data(txfd, msg, 0, msg->len);
+		if (receive_data(rxfd, msg, 0, msg->len)) {
+			/* Keep later round trips aligned */
+			receive_drain(rxfd);
+		} else {
+			rtt = now_ns() - start;
+			hist_add(&rtt_hist[len_bucket(msg->len)], rtt);
+			pr_debug("%u bytes: RTT %.1f µs\n", msg->len,
+				 rtt / 1e3);
+		}
+
+		free(msg);
+	}
+
+	close(rxfd);
+	close(txfd);
+}
+
+static void metric_add(const char *name, enum metric_kind kind, double val)
+{
+	struct metric *m = &metrics[nmetrics++];
+
+	snprintf(m->name, sizeof(m->name), "%s", name);
+	m->kind = kind;
+	m->val = val;
+}
+
+static void metrics_collect(void)
+{
+	double elapsed = (now_ns() - run_start) / 1e9;
+	static const char * const names[] = { "idle", "loaded" };
+	static const unsigned int pcts[] = { 50, 90, 99 };
+	char name[32];
+	unsigned int i;
+
+	metric_add("speed", METRIC_INFO, opt_speed);
+	metric_add("len", METRIC_INFO, opt_msglen);
+	metric_add("msgs", METRIC_INFO, msgs);
+	metric_add("msgs_per_s", METRIC_HIGHER, msgs / elapsed);
+	metric_add("bytes_per_s", METRIC_HIGHER, rx_bytes / elapsed);
+	metric_add("failure_rate", METRIC_LOWER,
+		   msgs ? (double)rx_failures / msgs : 0);
+
+	if (rx_skew_hist.count)
+		metric_add("rx_skew_p50_us", METRIC_LOWER,
+			   hist_percentile(&rx_skew_hist, 50) / 1e3);
+
+	if (msg_lat_hist.count)
+		for (i = 0; i < sizeof(pcts)/sizeof(*pcts); i++) {
+			snprintf(name, sizeof(name), "latency_p%u_us", pcts[i]);
+			metric_add(name, METRIC_LOWER,
+				   hist_percentile(&msg_lat_hist, pcts[i]) / 1e3);
+		}
+
+	for (i = 0; i < MSG_STAGES; i++)
+		if (stage_hist[i].count) {
+			snprintf(name, sizeof(name), "%s_p50_us",
+				 msg_stage_names[i]);
+			metric_add(name, METRIC_LOWER,
+				   hist_percentile(&stage_hist[i], 50) / 1e3);
+		}
+
+	if (nloads)
+		for (i = 0; i < 2; i++) {
+			if (!phase_stats[i].lat.count)
+				continue;
+			snprintf(name, sizeof(name), "%s_latency_p50_us",
+				 names[i]);
+			metric_add(name, METRIC_LOWER,
+				   hist_percentile(&phase_stats[i].lat, 50) / 1e3);
+		}
+}
+
+static const struct metric *metric_find(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < nmetrics; i++)
+		if (!strcmp(metrics[i].name, name))
+			return &metrics[i];
 
 	return NULL;
 }
 
+static double metric_tolerance(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ntolerances; i++)
+		if (!strcmp(tolerances[i].name, name))
+			return tolerances[i].pct;
+
+	return opt_tolerance;
+}
+
+static void baseline_save(const char *pathname)
+{
+	unsigned int i;
+	FILE *f;
+
+	f = fopen(pathname, "w");
+	if (!f) {
+		pr_error("Failed to open %s: %s\n", pathname, strerror(errno));
+		exit(-1);
+	}
+
+	fprintf(f, "# fifotest baseline: name value\n");
+	for (i = 0; i < nmetrics; i++)
+		fprintf(f, "%s %.9g\n", metrics[i].name, metrics[i].val);
+	fclose(f);
+
+	pr_info("Baseline saved to %s\n", pathname);
+}
+
+/*
+ * Compare the current run against a saved baseline, returning the number of
+ * metrics that regressed beyond their tolerance
+ */
+static unsigned int baseline_compare(const char *pathname)
+{
+	unsigned int regressions = 0;
+	const struct metric *m;
+	char line[128], name[32];
+	double base, tol, change;
+	const char *verdict;
+	FILE *f;
+
+	f = fopen(pathname, "r");
+	if (!f) {
+		pr_error("Failed to open %s: %s\n", pathname, strerror(errno));
+		exit(-1);
+	}
+
+	pr_info("Comparing against baseline %s:\n", pathname);
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' ||
+		    sscanf(line, "%31s %lf", name, &base) != 2)
+			continue;
+
+		m = metric_find(name);
+		if (!m) {
+			pr_warn("  %-24s not measured in this run\n", name);
+			continue;
+		}
+
+		if (m->kind == METRIC_INFO) {
+			if (m->val != base)
+				pr_warn("  %-24s %14.9g -> %-14.9g (configuration differs)\n",
+					name, base, m->val);
+			continue;
+		}
+
+		/* A zero baseline has no relative slack, any worsening counts */
+		tol = metric_tolerance(name) / 100;
+		change = base ? (m->val - base) / base * 100 : 0;
+		if (m->kind == METRIC_HIGHER ? m->val < base * (1 - tol)
+					     : m->val > base * (1 + tol)) {
+			verdict = ESC_RED "FAIL";
+			regressions++;
+		} else {
+			verdict = ESC_GREEN "pass";
+		}
+		pr_info("  %-24s %14.9g -> %-14.9g %+7.1f%% (±%g%%) %s\n",
+			name, base, m->val, change, tol * 100, verdict);
+	}
+	fclose(f);
+
+	if (regressions)
+		pr_error("Baseline: %u metric(s) regressed\n", regressions);
+	else
+		pr_info(ESC_GREEN "Baseline: PASS\n");
+
+	return regressions;
+}
+
 int main(int argc, char *argv[])
 {
 	while (argc > 1) {
-		if (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")) {
+		if (!strcmp(argv[1], "--baseline")) {
+			if (argc <= 2)
+				usage();
+			opt_baseline = argv[2];
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[1], "--break")) {
+			if (argc <= 2)
+				usage();
+			opt_break = strtoul(argv[2], NULL, 0);
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[1], "--break-at")) {
+			if (argc <= 2)
+				usage();
+			opt_break_at = strtoul(argv[2], NULL, 0);
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[1], "--characterize")) {
+			if (argc <= 2)
+				usage();
+			opt_characterize = strtoul(argv[2], NULL, 0);
+			if (!opt_characterize ||
+			    opt_characterize > MAX_MAX_MSG_LEN)
+				usage();
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[1], "--cpu-cost")) {
+			opt_cpu_cost = 1;
+		} else if (!strcmp(argv[1], "--duration")) {
+			if (argc <= 2)
+				usage();
+			opt_duration = strtoul(argv[2], NULL, 0);
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[1], "--echo")) {
+			opt_echo = 1;
+		} else if (!strcmp(argv[1], "--err-mod")) {
+			char *p = argv[2];
+
+			if (argc <= 2)
+				usage();
+			do {
+				if (opt_nerr_mods == MAX_ERR_MODS)
+					usage();
+				opt_err_mods[opt_nerr_mods] =
+					strtoul(p, &p, 0);
+				if (!opt_err_mods[opt_nerr_mods++])
+					usage();
+			} while (*p++ == ',');
+			if (p[-1])
+				usage();
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[1], "-f") ||
+			   !strcmp(argv[1], "--file")) {
+			if (argc <= 2)
+				usage();
+			opt_payload = argv[2];
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[1], "--flush-probe")) {
+			if (argc <= 2)
+				usage();
+			opt_flush_probe = strtoul(argv[2], NULL, 0);
+			if (!opt_flush_probe)
+				usage();
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[1], "--framing")) {
+			unsigned int i;
+
+			if (argc <= 2)
+				usage();
+			for (i = 0; i < sizeof(framings)/sizeof(*framings); i++)
+				if (!strcmp(argv[2], framings[i].name))
+					opt_framing = &framings[i];
+			if (!opt_framing)
+				usage();
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[1], "--gap")) {
+			char *end;
+
+			if (argc <= 2)
+				usage();
+			opt_gap_min = opt_gap_max = strtoul(argv[2], &end, 0);
+			if (*end == '-')
+				opt_gap_max = strtoul(end + 1, &end, 0);
+			if (*end || opt_gap_max < opt_gap_min)
+				usage();
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[1], "-h") ||
+			   !strcmp(argv[1], "--help")) {
 			usage();
 		} else if (!strcmp(argv[1], "-i") ||
 			   !strcmp(argv[1], "--seed")) {
@@ -467,6 +3849,23 @@ int main(int argc, char *argv[])
 			opt_seed = strtoul(argv[2], NULL, 0);
 			argv++;
 			argc--;
+		} else if (!strcmp(argv[1], "--irq")) {
+			if (argc <= 2)
+				usage();
+			opt_irq = argv[2];
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[1], "-k") ||
+			   !strcmp(argv[1], "--keep-going")) {
+			opt_keep_going = 1;
+		} else if (!strcmp(argv[1], "--latency-sweep")) {
+			opt_latency_sweep = 1;
+		} else if (!strcmp(argv[1], "--latency-timer")) {
+			if (argc <= 2)
+				usage();
+			opt_latency_timer = strtoul(argv[2], NULL, 0);
+			argv++;
+			argc--;
 		} else if (!strcmp(argv[1], "-l") ||
 			   !strcmp(argv[1], "--len")) {
 			if (argc <= 2)
@@ -474,6 +3873,61 @@ int main(int argc, char *argv[])
 			opt_msglen = strtoul(argv[2], NULL, 0);
 			if (!opt_msglen || opt_msglen > MAX_MAX_MSG_LEN)
 				usage();
+			opt_msglen_set = 1;
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[1], "--load")) {
+			struct load *load = &loads[nloads];
+			char *p, *cpu;
+			unsigned int i;
+
+			if (argc <= 2 || nloads == MAX_LOADS)
+				usage();
+			load->threads = 1;
+			load->duty = 100;
+			load->cpu = -1;
+			cpu = strchr(argv[2], '@');
+			if (cpu) {
+				*cpu++ = '\0';
+				load->cpu = strtoul(cpu, NULL, 0);
+			}
+			p = strchr(argv[2], ':');
+			if (p) {
+				*p++ = '\0';
+				load->threads = strtoul(p, &p, 0);
+				if (*p == ':')
+					load->duty = strtoul(p + 1, &p, 0);
+				if (*p || !load->threads || !load->duty ||
+				    load->duty > 100)
+					usage();
+			}
+			for (i = 0; i < sizeof(load_types)/sizeof(*load_types); i++)
+				if (!strcmp(argv[2], load_types[i]))
+					break;
+			if (i == sizeof(load_types)/sizeof(*load_types))
+				usage();
+			load->type = i;
+			nloads++;
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[1], "--load-phase")) {
+			if (argc <= 2)
+				usage();
+			opt_load_phase = strtoul(argv[2], NULL, 0);
+			if (!opt_load_phase)
+				usage();
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[1], "--modem")) {
+			unsigned int i;
+
+			if (argc <= 2)
+				usage();
+			for (i = 0; i < sizeof(modem_lines)/sizeof(*modem_lines); i++)
+				if (!strcmp(argv[2], modem_lines[i].name))
+					opt_modem = &modem_lines[i];
+			if (!opt_modem)
+				usage();
 			argv++;
 			argc--;
 		} else if (!strcmp(argv[1], "-n")) {
@@ -482,6 +3936,72 @@ int main(int argc, char *argv[])
 			opt_nmsgs = strtoul(argv[2], NULL, 0);
 			argv++;
 			argc--;
+		} else if (!strcmp(argv[1], "--open-bench")) {
+			opt_open_bench = 1;
+		} else if (!strcmp(argv[1], "--period")) {
+			if (argc <= 2)
+				usage();
+			opt_period = strtoul(argv[2], NULL, 0);
+			if (!opt_period)
+				usage();
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[1], "--perf")) {
+			opt_cpu_cost = opt_perf = 1;
+		} else if (!strcmp(argv[1], "--pingpong")) {
+			opt_pingpong = 1;
+		} else if (!strcmp(argv[1], "--prefetch")) {
+			if (argc <= 2)
+				usage();
+			opt_prefetch = strtoul(argv[2], NULL, 0);
+			if (!opt_prefetch || opt_prefetch > MAX_LIST_SIZE)
+				usage();
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[1], "--qsample")) {
+			if (argc <= 2)
+				usage();
+			opt_qsample = strtoul(argv[2], NULL, 0);
+			if (!opt_qsample)
+				usage();
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[1], "--qlog")) {
+			if (argc <= 2)
+				usage();
+			opt_qlog = argv[2];
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[1], "--rate")) {
+			char *end;
+
+			if (argc <= 2)
+				usage();
+			opt_rate = strtoul(argv[2], &end, 0);
+			opt_rate_bytes = *end == 'B';
+			if (!opt_rate || end[opt_rate_bytes])
+				usage();
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[1], "--rs485")) {
+			char *end;
+
+			if (argc <= 2)
+				usage();
+			opt_rs485 = 1;
+			opt_rs485_before = strtoul(argv[2], &end, 0);
+			if (*end == ',')
+				opt_rs485_after = strtoul(end + 1, &end, 0);
+			if (*end)
+				usage();
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[1], "--save-baseline")) {
+			if (argc <= 2)
+				usage();
+			opt_save_baseline = argv[2];
+			argv++;
+			argc--;
 		} else if (!strcmp(argv[1], "-s") ||
 			   !strcmp(argv[1], "--speed")) {
 			if (argc <= 2)
@@ -489,13 +4009,73 @@ int main(int argc, char *argv[])
 			opt_speed = strtoul(argv[2], NULL, 0);
 			argv++;
 			argc--;
+		} else if (!strcmp(argv[1], "--search")) {
+			opt_search = 1;
+		} else if (!strcmp(argv[1], "--search-window")) {
+			if (argc <= 2)
+				usage();
+			opt_search_window = strtoul(argv[2], NULL, 0);
+			if (!opt_search_window)
+				usage();
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[1], "--tolerance")) {
+			char *p, *end;
+			double pct;
+
+			if (argc <= 2)
+				usage();
+			p = strchr(argv[2], '=');
+			pct = strtod(p ? p + 1 : argv[2], &end);
+			if (*end || pct < 0)
+				usage();
+			if (p) {
+				if (ntolerances == MAX_TOLERANCES)
+					usage();
+				*p = '\0';
+				tolerances[ntolerances].name = argv[2];
+				tolerances[ntolerances++].pct = pct;
+			} else {
+				opt_tolerance = pct;
+			}
+			argv++;
+			argc--;
 		} else if (!strcmp(argv[1], "-v") ||
 			   !strcmp(argv[1], "--verbose")) {
 			opt_verbose = 1;
+		} else if (!strcmp(argv[1], "--verify")) {
+			char *p;
+			unsigned int i;
+
+			if (argc <= 2)
+				usage();
+			p = strchr(argv[2], ':');
+			if (p)
+				*p++ = '\0';
+			for (i = 0; i < sizeof(verify_modes)/sizeof(*verify_modes); i++)
+				if (!strcmp(argv[2], verify_modes[i]))
+					break;
+			if (i == sizeof(verify_modes)/sizeof(*verify_modes))
+				usage();
+			opt_verify = i;
+			opt_verify_n = opt_verify == VERIFY_HASH ?
+				       DEFAULT_HASH_BLOCK : DEFAULT_SAMPLE_STEP;
+			if (p) {
+				opt_verify_n = strtoul(p, &p, 0);
+				if (*p || !opt_verify_n ||
+				    opt_verify == VERIFY_FULL)
+					usage();
+			}
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[1], "--verify-thread")) {
+			opt_verify_thread = 1;
 		} else if (!opt_txdev) {
 			opt_txdev = argv[1];
-		} else if (!opt_rxdev) {
-			opt_rxdev = argv[1];
+		} else if (nreceivers < MAX_RECEIVERS) {
+			if (!opt_rxdev)
+				opt_rxdev = argv[1];
+			receivers[nreceivers++].pathname = argv[1];
 		} else {
 			usage();
 		}
@@ -506,29 +4086,135 @@ int main(int argc, char *argv[])
 	if (!opt_rxdev)
 		usage();
 
+	/*
+	 * Frames are generated, and a break would corrupt them.  Only the
+	 * message loop decodes them, and bursts are cut to a byte length.
+	 */
+	if (opt_framing && (opt_payload || opt_break >= 0 || opt_pingpong ||
+			    opt_period || opt_characterize))
+		usage();
+
+	/* These keep per-message receive state for a single receiver */
+	if (nreceivers > 1 &&
+	    (opt_framing || opt_break >= 0 || opt_verify_thread ||
+	     opt_verify != VERIFY_FULL || opt_flush_probe))
+		usage();
+
 	brahe_prng_init(&prng, BRAHE_PRNG_MARSENNE_TWISTER, opt_seed);
+	brahe_prng_init(&gap_prng, BRAHE_PRNG_MARSENNE_TWISTER, opt_seed);
+	sem_init(&rx_ready, 0, 0);
+	port_defaults();
+	err_stats_init();
+	if (opt_irq)
+		irq_init();
+
+	if (opt_payload)
+		payload_map_file(opt_payload);
+
+	if (opt_qlog) {
+		qlog = fopen(opt_qlog, "w");
+		if (!qlog) {
+			pr_error("Failed to open %s: %s\n", opt_qlog,
+				 strerror(errno));
+			exit(-1);
+		}
+		fprintf(qlog, "# msg t_us outq inq\n");
+	}
 
 	sigaction(SIGINT, &signal_action, NULL);
 
-	for (msgs = 0; !opt_nmsgs || msgs < opt_nmsgs; msgs++) {
-		struct timespec delay = { .tv_nsec = 100 * 1000 * 1000 };
-		struct msg *msg = msg_gen(-opt_msglen);
+	run_start = now_ns();
 
-		pthread_create(&rx_thread, NULL, receive_start, msg);
+	latency_timer_init();
+	if (opt_latency_timer >= 0)
+		latency_timer_apply(opt_latency_timer);
 
-		/* Wait a bit to make sure the receiver thread has started */
-		nanosleep(&delay, NULL);
+	if (opt_latency_sweep) {
+		latency_timer_sweep();
+		print_stats();
+		exit(0);
+	}
+
+	if (opt_echo)
+		echo_respond();
+
+	if (opt_pingpong) {
+		pingpong();
+		print_stats();
+		exit(rx_failures ? -1 : 0);
+	}
+
+	if (opt_characterize) {
+		characterize();
+		print_stats();
+		exit(rx_failures ? -1 : 0);
+	}
+
+	if (opt_period) {
+		period_bench();
+		print_stats();
+		exit(rx_failures ? -1 : 0);
+	}
+
+	if (opt_open_bench) {
+		open_bench();
+		print_stats();
+		exit(0);
+	}
+
+	if (opt_modem) {
+		modem_bench();
+		print_stats();
+		exit(modem_errors ? -1 : 0);
+	}
+
+	if (opt_search) {
+		search_envelope();
+		print_stats();
+		exit(0);
+	}
+
+	if (opt_prefetch) {
+		/* Keep message generation off the critical path */
+		sem_init(&msg_ring_space, 0, opt_prefetch);
+		sem_init(&msg_ring_filled, 0, 0);
+		pthread_create(&gen_thread, NULL, gen_start, NULL);
+	}
 
-		pthread_create(&tx_thread, NULL, transmit_start, msg);
+	load_init();
 
-		pthread_join(rx_thread, NULL);
-		pthread_join(tx_thread, NULL);
+	for (msgs = 0; !run_done(); msgs++) {
+		unsigned int i, failures = rx_failures;
+		struct cpu_sample cs;
+		struct msg *msg;
+		uint64_t cpu = 0;
 
+		cpu_begin(&cs);
+		msg = opt_prefetch ? msg_dequeue() : msg_next();
+		load_phase_start();
+		run_msg(msg);
+		load_phase_end(msg, failures);
+		msg->cpu[CPU_MAIN] = cpu_end(&cs, CPU_MAIN);
+		if (opt_cpu_cost) {
+			for (i = 0; i < CPU_ROLES; i++)
+				cpu += msg->cpu[i];
+			hist_add(&cpu_msg_hist, cpu);
+		}
 		free(msg);
 	}
 
 	print_stats();
 
-	exit(0);
+	if (qlog)
+		fclose(qlog);
+
+	if (opt_save_baseline || opt_baseline)
+		metrics_collect();
+	if (opt_save_baseline)
+		baseline_save(opt_save_baseline);
+	if (opt_baseline && baseline_compare(opt_baseline))
+		exit(-1);
+
+	exit(rx_failures ? -1 : 0);
 }
 